@@ -54,23 +54,69 @@ typedef ptr (*IOComplete)(DWORD count, LPOVERLAPPED overlapped, DWORD error);
 
 void PostIOComplete(DWORD count, IOComplete callback, LPOVERLAPPED overlapped);
 
+// A SharedBuffer holds native data that outlives any one owner, such
+// as the contents of a cached file that is being written to several
+// sockets. It is deleted when the last reference is released.
+
+class SharedBuffer
+{
+public:
+  BYTE* Data;
+  size_t Size;
+  SharedBuffer(size_t size)
+  {
+    Data = (0 == size) ? NULL : new BYTE[size];
+    Size = size;
+    RefCount = 1;
+  }
+  void AddRef()
+  {
+    InterlockedIncrement(&RefCount);
+  }
+  void Release()
+  {
+    if (InterlockedDecrement(&RefCount) == 0)
+      delete this;
+  }
+private:
+  LONG RefCount;
+  ~SharedBuffer()
+  {
+    delete [] Data;
+  }
+};
+
 class OverlappedRequest
 {
 public:
   OVERLAPPED Overlapped;
   ptr Buffer;
+  SharedBuffer* Shared;
   ptr Callback;
   OverlappedRequest(ptr buffer, ptr callback)
   {
     ZeroMemory(&Overlapped, sizeof(Overlapped));
     Buffer = buffer;
+    Shared = NULL;
     Callback = callback;
     Slock_object(Buffer);
     Slock_object(Callback);
   }
+  OverlappedRequest(SharedBuffer* shared, ptr callback)
+  {
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Buffer = Sfalse;
+    Shared = shared;
+    Shared->AddRef();
+    Callback = callback;
+    Slock_object(Callback);
+  }
   ~OverlappedRequest()
   {
-    Sunlock_object(Buffer);
+    if (NULL == Shared)
+      Sunlock_object(Buffer);
+    else
+      Shared->Release();
     Sunlock_object(Callback);
   }
   static ptr Complete(DWORD count, LPOVERLAPPED overlapped, DWORD error)
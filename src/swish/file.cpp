@@ -37,77 +37,118 @@ void file_init()
   DEFINE_FOREIGN(osi::GetFullPath);
   DEFINE_FOREIGN(osi::WatchDirectory);
   DEFINE_FOREIGN(osi::CloseDirectoryWatcher);
+  DEFINE_FOREIGN(osi::CreateFileAsync);
+  DEFINE_FOREIGN(osi::DeleteFileAsync);
+  DEFINE_FOREIGN(osi::MoveFileAsync);
+  DEFINE_FOREIGN(osi::CreateDirectoryAsync);
+  DEFINE_FOREIGN(osi::RemoveDirectoryAsync);
+  DEFINE_FOREIGN(osi::GetDiskFreeSpaceAsync);
+  DEFINE_FOREIGN(osi::GetFullPathAsync);
+  DEFINE_FOREIGN(osi::GetFileInfo);
+  DEFINE_FOREIGN(osi::CopyFile);
+  DEFINE_FOREIGN(osi::MapFile);
+  DEFINE_FOREIGN(osi::UnmapFile);
+  DEFINE_FOREIGN(osi::GetMappingSize);
+  DEFINE_FOREIGN(osi::GetMappingAddress);
+  DEFINE_FOREIGN(osi::ReadMapping);
+  DEFINE_FOREIGN(osi::CompareMapping);
+  DEFINE_FOREIGN(osi::SearchMapping);
+  DEFINE_FOREIGN(osi::WalkDirectory);
+  DEFINE_FOREIGN(osi::SetFileCacheLimit);
+  DEFINE_FOREIGN(osi::OpenCachedFile);
+  DEFINE_FOREIGN(osi::CloseCachedFile);
+  DEFINE_FOREIGN(osi::GetCachedFileSize);
+  DEFINE_FOREIGN(osi::WriteCachedFile);
+  DEFINE_FOREIGN(osi::InvalidateCachedFiles);
+  DEFINE_FOREIGN(osi::GetFileCacheStatistics);
 }
 
-ptr osi::CreateFile(ptr name, UINT desiredAccess, UINT shareMode, UINT creationDisposition)
+class FilePort : public Port
 {
-  class FilePort : public Port
+public:
+  HANDLE Handle;
+  FilePort(HANDLE h)
   {
-  public:
-    HANDLE Handle;
-    FilePort(HANDLE h)
-    {
-      Handle = h;
-    }
-    virtual ptr Read(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+    Handle = h;
+  }
+  virtual ptr Read(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+  {
+    UINT64 fp = Sunsigned64_value(filePosition);
+    OverlappedRequest* req = new OverlappedRequest(buffer, callback);
+    *(UINT64*)(&req->Overlapped.Offset) = fp;
+    if (!ReadFile(Handle, &Sbytevector_u8_ref(buffer, startIndex), size, NULL, &req->Overlapped))
     {
-      UINT64 fp = Sunsigned64_value(filePosition);
-      OverlappedRequest* req = new OverlappedRequest(buffer, callback);
-      *(UINT64*)(&req->Overlapped.Offset) = fp;
-      if (!ReadFile(Handle, &Sbytevector_u8_ref(buffer, startIndex), size, NULL, &req->Overlapped))
+      DWORD error = GetLastError();
+      if (ERROR_IO_PENDING != error)
       {
-        DWORD error = GetLastError();
-        if (ERROR_IO_PENDING != error)
-        {
-          delete req;
-          return MakeErrorPair("ReadFile", error);
-        }
+        delete req;
+        return MakeErrorPair("ReadFile", error);
       }
-      return Strue;
     }
-    virtual ptr Write(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+    return Strue;
+  }
+  virtual ptr Write(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+  {
+    UINT64 fp = Sunsigned64_value(filePosition);
+    OverlappedRequest* req = new OverlappedRequest(buffer, callback);
+    *(UINT64*)(&req->Overlapped.Offset) = fp;
+    if (!WriteFile(Handle, &Sbytevector_u8_ref(buffer, startIndex), size, NULL, &req->Overlapped))
     {
-      UINT64 fp = Sunsigned64_value(filePosition);
-      OverlappedRequest* req = new OverlappedRequest(buffer, callback);
-      *(UINT64*)(&req->Overlapped.Offset) = fp;
-      if (!WriteFile(Handle, &Sbytevector_u8_ref(buffer, startIndex), size, NULL, &req->Overlapped))
+      DWORD error = GetLastError();
+      if (ERROR_IO_PENDING != error)
       {
-        DWORD error = GetLastError();
-        if (ERROR_IO_PENDING != error)
-        {
-          delete req;
-          return MakeErrorPair("WriteFile", error);
-        }
+        delete req;
+        return MakeErrorPair("WriteFile", error);
       }
-      return Strue;
-    }
-    virtual ptr Close()
-    {
-      CloseHandle(Handle);
-      delete this;
-      return Strue;
     }
-    virtual ptr GetFileSize()
-    {
-      UINT64 size;
-      if (GetFileSizeEx(Handle, (PLARGE_INTEGER)&size) == 0)
-        return MakeLastErrorPair("GetFileSizeEx");
-      return Sunsigned64(size);
-    }
-  };
+    return Strue;
+  }
+  virtual ptr Close()
+  {
+    CloseHandle(Handle);
+    delete this;
+    return Strue;
+  }
+  virtual ptr GetFileSize()
+  {
+    UINT64 size;
+    if (GetFileSizeEx(Handle, (PLARGE_INTEGER)&size) == 0)
+      return MakeLastErrorPair("GetFileSizeEx");
+    return Sunsigned64(size);
+  }
+};
 
-  if (!Sstringp(name))
-    return MakeErrorPair("osi::CreateFile", ERROR_BAD_ARGUMENTS);
-  WideString wname(name);
-  HANDLE h = ::CreateFileW(wname.GetBuffer(), desiredAccess, shareMode, NULL, creationDisposition, FILE_FLAG_OVERLAPPED, NULL);
+// OpenFile does not touch any Scheme object, so it is safe to call from
+// a worker thread. On failure, it sets who and returns 0 or the error.
+static DWORD OpenFile(const wchar_t* name, UINT desiredAccess, UINT shareMode, UINT creationDisposition, HANDLE& h, const char*& who)
+{
+  h = ::CreateFileW(name, desiredAccess, shareMode, NULL, creationDisposition, FILE_FLAG_OVERLAPPED, NULL);
   if (INVALID_HANDLE_VALUE == h)
-    return MakeLastErrorPair("CreateFileW");
+  {
+    who = "CreateFileW";
+    return GetLastError();
+  }
   if (CreateIoCompletionPort(h, g_CompletionPort, (ULONG_PTR)OverlappedRequest::Complete, 0) == NULL)
   {
     DWORD error = GetLastError();
     CloseHandle(h);
-    return MakeErrorPair("CreateIoCompletionPort", error);
+    h = INVALID_HANDLE_VALUE;
+    who = "CreateIoCompletionPort";
+    return error;
   }
+  return 0;
+}
+
+ptr osi::CreateFile(ptr name, UINT desiredAccess, UINT shareMode, UINT creationDisposition)
+{
+  if (!Sstringp(name))
+    return MakeErrorPair("osi::CreateFile", ERROR_BAD_ARGUMENTS);
+  WideString wname(name);
+  HANDLE h;
+  const char* who;
+  DWORD error = OpenFile(wname.GetBuffer(), desiredAccess, shareMode, creationDisposition, h, who);
+  if (0 != error)
+    return MakeErrorPair(who, error);
   return PortToScheme(new FilePort(h));
 }
 
@@ -319,154 +360,1400 @@ ptr osi::GetFullPath(ptr path)
   return MakeSchemeString(wfull.GetBuffer());
 }
 
-class ChangesRequest;
+static INT64 FileTimeToMilliseconds(const FILETIME& ft)
+{
+  // ft is the number of 100-nanosecond intervals since 1 Jan 1601 (UTC).
+  // 11644473600000 is the number of milliseconds from 1 Jan 1601 to 1 Jan 1970.
+  UINT64 t = ((UINT64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  return (INT64)(t / 10000L) - 11644473600000L;
+}
 
-typedef HandleMap<ChangesRequest*, 32801> WatcherMap;
-WatcherMap g_Watchers;
+// The asynchronous variants below perform the same system calls as
+// their synchronous counterparts on a worker thread so that a slow or
+// unresponsive volume does not block the event loop. Each one posts
+// (callback result) where result is an error pair on failure.
 
-class ChangesRequest
+class PathWorker : public WorkItem
 {
 public:
-  OVERLAPPED Overlapped;
-  HANDLE Handle;
-  iptr SchemeHandle;
-  bool Subtree;
-  int RefCount;
-  FILE_NOTIFY_INFORMATION* Buffer;
-  static const size_t BufferSize = 65536;
+  wchar_t* Path;
+  wchar_t* Path2;
   ptr Callback;
-  ChangesRequest(HANDLE handle, bool subtree, ptr callback)
+  const char* ErrorWho;
+  PathWorker(wchar_t* path, wchar_t* path2, ptr callback, const char* who)
   {
-    ZeroMemory(&Overlapped, sizeof(Overlapped));
-    Handle = handle;
-    SchemeHandle = g_Watchers.Allocate(this);
-    Subtree = subtree;
-    RefCount = 1;
-    Buffer = (FILE_NOTIFY_INFORMATION*)malloc(BufferSize);
+    Path = path;
+    Path2 = path2;
     Callback = callback;
+    ErrorWho = who;
     Slock_object(Callback);
   }
-  ~ChangesRequest()
+  virtual ~PathWorker()
   {
+    delete [] Path;
+    delete [] Path2;
     Sunlock_object(Callback);
-    free(Buffer);
   }
-  void Close()
+  DWORD Check(BOOL ok)
   {
-    CloseHandle(Handle);
-    Handle = INVALID_HANDLE_VALUE;
-    g_Watchers.Deallocate(SchemeHandle);
-    Release();
+    return ok ? 0 : GetLastError();
   }
-  void AddRef()
+  virtual ptr GetResult()
   {
-    RefCount++;
+    return Strue;
   }
-  void Release()
+  virtual ptr GetCompletionPacket(DWORD error)
   {
-    if (--RefCount == 0)
-      delete this;
+    ptr callback = Callback;
+    ptr result = (0 == error) ? GetResult() : MakeErrorPair(ErrorWho, error);
+    delete this;
+    return MakeList(callback, result);
   }
-  DWORD ReadDirectoryChanges()
+};
+
+ptr osi::CreateFileAsync(ptr name, UINT desiredAccess, UINT shareMode, UINT creationDisposition, ptr callback)
+{
+  class FileOpener : public PathWorker
   {
-    DWORD n;
-    if (!ReadDirectoryChangesW(Handle, Buffer, BufferSize, Subtree, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, &n, &Overlapped, NULL))
-      return GetLastError();
-    else
+  public:
+    UINT DesiredAccess;
+    UINT ShareMode;
+    UINT CreationDisposition;
+    HANDLE Handle;
+    FileOpener(wchar_t* name, UINT desiredAccess, UINT shareMode, UINT creationDisposition, ptr callback) : PathWorker(name, NULL, callback, NULL)
     {
-      AddRef();
-      return 0;
+      DesiredAccess = desiredAccess;
+      ShareMode = shareMode;
+      CreationDisposition = creationDisposition;
+      Handle = INVALID_HANDLE_VALUE;
     }
-  }
-  void ReadNext()
-  {
-    if (INVALID_HANDLE_VALUE == Handle)
+    virtual DWORD Work()
     {
-      AddRef();
-      PostIOComplete(0, Error, &Overlapped);
+      return OpenFile(Path, DesiredAccess, ShareMode, CreationDisposition, Handle, ErrorWho);
     }
-    else
+    virtual ptr GetResult()
     {
-      DWORD rc = ReadDirectoryChanges();
-      if (0 != rc)
-      {
-        AddRef();
-        PostIOComplete(rc, Error, &Overlapped);
-      }
+      return PortToScheme(new FilePort(Handle));
     }
-  }
-  ptr ToScheme(DWORD count, DWORD error)
+  };
+
+  if (!Sstringp(name) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::CreateFileAsync", ERROR_BAD_ARGUMENTS);
+  WideString wname(name);
+  return StartWorker(new FileOpener(wname.GetDetachedBuffer(), desiredAccess, shareMode, creationDisposition, callback));
+}
+
+ptr osi::DeleteFileAsync(ptr name, ptr callback)
+{
+  class FileDeleter : public PathWorker
   {
-    if (0 == count) return Sunsigned(error);
-    std::vector<FILE_NOTIFY_INFORMATION*> data;
-    FILE_NOTIFY_INFORMATION* p = Buffer;
-    DWORD offset;
-    while (1)
+  public:
+    FileDeleter(wchar_t* name, ptr callback) : PathWorker(name, NULL, callback, "DeleteFileW") {}
+    virtual DWORD Work()
     {
-      data.push_back(p);
-      offset = p->NextEntryOffset;
-      if (0 == offset) break;
-      p = (FILE_NOTIFY_INFORMATION*)((iptr)p + offset);
+      return Check(::DeleteFileW(Path));
     }
-    ptr r = Snil;
-    std::vector<FILE_NOTIFY_INFORMATION*>::reverse_iterator iter = data.rbegin();
-    for (; iter != data.rend(); iter++)
+  };
+
+  if (!Sstringp(name) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::DeleteFileAsync", ERROR_BAD_ARGUMENTS);
+  WideString wname(name);
+  return StartWorker(new FileDeleter(wname.GetDetachedBuffer(), callback));
+}
+
+ptr osi::MoveFileAsync(ptr existingPath, ptr newPath, UINT flags, ptr callback)
+{
+  class FileMover : public PathWorker
+  {
+  public:
+    UINT Flags;
+    FileMover(wchar_t* existingPath, wchar_t* newPath, UINT flags, ptr callback) : PathWorker(existingPath, newPath, callback, "MoveFileExW")
     {
-      p = *iter;
-      r = Scons(Scons(Sfixnum(p->Action), MakeSchemeString(p->FileName, p->FileNameLength)), r);
+      Flags = flags;
     }
-    return r;
-  }
-  static ptr Complete(DWORD count, LPOVERLAPPED overlapped, DWORD error)
-  {
-    ChangesRequest* req = (ChangesRequest*)((size_t)overlapped - offsetof(ChangesRequest, Overlapped));
-    ptr callback = req->Callback;
-    ptr r = req->ToScheme(count, error);
-    if (0 != count)
-      req->ReadNext();
-    req->Release();
-    return MakeList(callback, r);
-  }
-  static ptr Error(DWORD count, LPOVERLAPPED overlapped, DWORD)
+    virtual DWORD Work()
+    {
+      return Check(::MoveFileExW(Path, Path2, Flags));
+    }
+  };
+
+  if (!Sstringp(existingPath) || !Sstringp(newPath) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::MoveFileAsync", ERROR_BAD_ARGUMENTS);
+  WideString wexistingPath(existingPath);
+  WideString wnewPath(newPath);
+  return StartWorker(new FileMover(wexistingPath.GetDetachedBuffer(), wnewPath.GetDetachedBuffer(), flags, callback));
+}
+
+ptr osi::CreateDirectoryAsync(ptr path, ptr callback)
+{
+  class DirectoryCreator : public PathWorker
   {
-    ChangesRequest* req = (ChangesRequest*)((size_t)overlapped - offsetof(ChangesRequest, Overlapped));
-    ptr callback = req->Callback;
-    req->Release();
-    return MakeList(callback, Sunsigned(count));
-  }
-};
+  public:
+    DirectoryCreator(wchar_t* path, ptr callback) : PathWorker(path, NULL, callback, "CreateDirectoryW") {}
+    virtual DWORD Work()
+    {
+      return Check(::CreateDirectoryW(Path, NULL));
+    }
+  };
 
-ptr osi::WatchDirectory(ptr path, bool subtree, ptr callback)
+  if (!Sstringp(path) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::CreateDirectoryAsync", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  return StartWorker(new DirectoryCreator(wpath.GetDetachedBuffer(), callback));
+}
+
+ptr osi::RemoveDirectoryAsync(ptr path, ptr callback)
 {
+  class DirectoryRemover : public PathWorker
+  {
+  public:
+    DirectoryRemover(wchar_t* path, ptr callback) : PathWorker(path, NULL, callback, "RemoveDirectoryW") {}
+    virtual DWORD Work()
+    {
+      return Check(::RemoveDirectoryW(Path));
+    }
+  };
+
   if (!Sstringp(path) || !Sprocedurep(callback))
-    return MakeErrorPair("osi::WatchDirectory", ERROR_BAD_ARGUMENTS);
+    return MakeErrorPair("osi::RemoveDirectoryAsync", ERROR_BAD_ARGUMENTS);
   WideString wpath(path);
-  HANDLE h = ::CreateFileW(wpath.GetBuffer(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_BACKUP_SEMANTICS, NULL);
-  if (INVALID_HANDLE_VALUE == h)
-    return MakeLastErrorPair("CreateFileW");
-  if (CreateIoCompletionPort(h, g_CompletionPort, (ULONG_PTR)ChangesRequest::Complete, 0) == NULL)
+  return StartWorker(new DirectoryRemover(wpath.GetDetachedBuffer(), callback));
+}
+
+ptr osi::GetDiskFreeSpaceAsync(ptr path, ptr callback)
+{
+  class FreeSpaceGetter : public PathWorker
   {
-    DWORD error = GetLastError();
-    CloseHandle(h);
-    return MakeErrorPair("CreateIoCompletionPort", error);
-  }
-  ChangesRequest* req = new ChangesRequest(h, subtree, callback);
-  DWORD rc = req->ReadDirectoryChanges();
-  if (0 == rc)
-    return Sfixnum(req->SchemeHandle);
-  else
+  public:
+    UINT64 Free;
+    FreeSpaceGetter(wchar_t* path, ptr callback) : PathWorker(path, NULL, callback, "GetDiskFreeSpaceExW")
+    {
+      Free = 0;
+    }
+    virtual DWORD Work()
+    {
+      return Check(::GetDiskFreeSpaceExW(Path, (PULARGE_INTEGER)&Free, NULL, NULL));
+    }
+    virtual ptr GetResult()
+    {
+      return Sunsigned64(Free);
+    }
+  };
+
+  if (!Sstringp(path) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::GetDiskFreeSpaceAsync", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  return StartWorker(new FreeSpaceGetter(wpath.GetDetachedBuffer(), callback));
+}
+
+ptr osi::GetFullPathAsync(ptr path, ptr callback)
+{
+  class FullPathGetter : public PathWorker
   {
-    req->Close();
-    return MakeErrorPair("ReadDirectoryChangesW", rc);
-  }
+  public:
+    UTF16Buffer Full;
+    FullPathGetter(wchar_t* path, ptr callback) : PathWorker(path, NULL, callback, "GetFullPathNameW") {}
+    virtual DWORD Work()
+    {
+      DWORD n = GetFullPathNameW(Path, Full.GetLength(), Full.GetBuffer(), NULL);
+      if (0 == n)
+        return GetLastError();
+      if (n > Full.GetLength())
+      {
+        Full.Allocate(n);
+        if (GetFullPathNameW(Path, Full.GetLength(), Full.GetBuffer(), NULL) == 0)
+          return GetLastError();
+      }
+      return 0;
+    }
+    virtual ptr GetResult()
+    {
+      return MakeSchemeString(Full.GetBuffer());
+    }
+  };
+
+  if (!Sstringp(path) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::GetFullPathAsync", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  return StartWorker(new FullPathGetter(wpath.GetDetachedBuffer(), callback));
 }
 
-ptr osi::CloseDirectoryWatcher(iptr watcher)
+ptr osi::CopyFile(ptr existingPath, ptr newPath, UINT flags, ALG_ID alg, UINT progressInterval, ptr callback)
 {
-  static ChangesRequest* missing = NULL;
-  ChangesRequest* req = g_Watchers.Lookup(watcher, missing);
-  if (NULL == req)
-    return MakeErrorPair("osi::CloseDirectoryWatcher", ERROR_INVALID_HANDLE);
-  req->Close();
-  return Strue;
+  class FileCopier : public PathWorker
+  {
+  public:
+    enum { BufferSize = 1024 * 1024 };
+    UINT Flags;
+    HCRYPTHASH Hash;
+    DWORD ProgressInterval;
+    DWORD LastProgress;
+    volatile LONG ProgressPending;
+    UINT64 ProgressBytes;
+    FileCopier(wchar_t* existingPath, wchar_t* newPath, UINT flags, HCRYPTHASH hash, UINT progressInterval, ptr callback) : PathWorker(existingPath, newPath, callback, NULL)
+    {
+      Flags = flags;
+      Hash = hash;
+      ProgressInterval = progressInterval;
+      LastProgress = ::GetTickCount();
+      ProgressPending = 0;
+      ProgressBytes = 0;
+    }
+    virtual ~FileCopier()
+    {
+      if (0 != Hash)
+        CryptDestroyHash(Hash);
+    }
+    virtual DWORD Work()
+    {
+      if (0 == Hash)
+      {
+        // Without a digest, let the system pick the fastest copy, which
+        // includes server-side copies and block cloning where supported.
+        BOOL cancel = FALSE;
+        DWORD copyFlags = (Flags & COPY_FILE_FAIL_IF_EXISTS);
+        if (!CopyFileExW(Path, Path2, CopyProgress, this, &cancel, copyFlags))
+        {
+          ErrorWho = "CopyFileExW";
+          return GetLastError();
+        }
+        return 0;
+      }
+      return CopyAndHash();
+    }
+    DWORD CopyAndHash()
+    {
+      HANDLE from = ::CreateFileW(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (INVALID_HANDLE_VALUE == from)
+      {
+        ErrorWho = "CreateFileW";
+        return GetLastError();
+      }
+      HANDLE to = ::CreateFileW(Path2, GENERIC_WRITE, 0, NULL, (Flags & COPY_FILE_FAIL_IF_EXISTS) ? CREATE_NEW : CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+      if (INVALID_HANDLE_VALUE == to)
+      {
+        DWORD error = GetLastError();
+        CloseHandle(from);
+        ErrorWho = "CreateFileW";
+        return error;
+      }
+      BYTE* buffer[2];
+      buffer[0] = (BYTE*)malloc(BufferSize);
+      buffer[1] = (BYTE*)malloc(BufferSize);
+      OVERLAPPED r;
+      OVERLAPPED w;
+      ZeroMemory(&r, sizeof(r));
+      ZeroMemory(&w, sizeof(w));
+      r.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+      w.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+      DWORD error = 0;
+      if ((NULL == buffer[0]) || (NULL == buffer[1]) || (NULL == r.hEvent) || (NULL == w.hEvent))
+      {
+        ErrorWho = "osi::CopyFile";
+        error = ERROR_NOT_ENOUGH_MEMORY;
+      }
+      // Read into one buffer while the other is hashed and written.
+      UINT64 position = 0;
+      bool reading = false;
+      bool writing = false;
+      int current = 0;
+      if (0 == error)
+        error = StartIO(from, false, buffer[current], BufferSize, position, r, reading);
+      while (0 == error)
+      {
+        DWORD n = 0;
+        if (reading)
+        {
+          reading = false;
+          error = FinishIO(from, false, r, n);
+          if (0 != error)
+            break;
+        }
+        if (0 == n)
+          break;
+        if (writing)
+        {
+          DWORD written;
+          writing = false;
+          error = FinishIO(to, true, w, written);
+          if (0 != error)
+            break;
+        }
+        error = StartIO(from, false, buffer[1 - current], BufferSize, position + n, r, reading);
+        if (0 != error)
+          break;
+        if (!CryptHashData(Hash, buffer[current], n, 0))
+        {
+          ErrorWho = "CryptHashData";
+          error = GetLastError();
+          break;
+        }
+        error = StartIO(to, true, buffer[current], n, position, w, writing);
+        if (0 != error)
+          break;
+        position += n;
+        current = 1 - current;
+        Progress(position);
+      }
+      DWORD n;
+      if (writing)
+      {
+        DWORD rc = FinishIO(to, true, w, n);
+        if (0 == error)
+          error = rc;
+      }
+      if (reading)
+      {
+        // Wait for the outstanding read before freeing its buffer.
+        CancelIo(from);
+        GetOverlappedResult(from, &r, &n, TRUE);
+      }
+      if (NULL != r.hEvent)
+        CloseHandle(r.hEvent);
+      if (NULL != w.hEvent)
+        CloseHandle(w.hEvent);
+      free(buffer[0]);
+      free(buffer[1]);
+      CloseHandle(from);
+      CloseHandle(to);
+      if (0 != error)
+        ::DeleteFileW(Path2);
+      return error;
+    }
+    DWORD StartIO(HANDLE h, bool write, BYTE* buffer, DWORD size, UINT64 position, OVERLAPPED& overlapped, bool& pending)
+    {
+      *(UINT64*)(&overlapped.Offset) = position;
+      ResetEvent(overlapped.hEvent);
+      BOOL ok = write ?
+        WriteFile(h, buffer, size, NULL, &overlapped) :
+        ReadFile(h, buffer, size, NULL, &overlapped);
+      if (!ok)
+      {
+        DWORD error = GetLastError();
+        if (!write && (ERROR_HANDLE_EOF == error))
+        {
+          pending = false;
+          return 0;
+        }
+        if (ERROR_IO_PENDING != error)
+        {
+          ErrorWho = write ? "WriteFile" : "ReadFile";
+          return error;
+        }
+      }
+      pending = true;
+      return 0;
+    }
+    DWORD FinishIO(HANDLE h, bool write, OVERLAPPED& overlapped, DWORD& n)
+    {
+      n = 0;
+      if (!GetOverlappedResult(h, &overlapped, &n, TRUE))
+      {
+        DWORD error = GetLastError();
+        if (!write && (ERROR_HANDLE_EOF == error))
+          return 0;
+        ErrorWho = write ? "WriteFile" : "ReadFile";
+        return error;
+      }
+      return 0;
+    }
+    static DWORD CALLBACK CopyProgress(LARGE_INTEGER, LARGE_INTEGER transferred, LARGE_INTEGER, LARGE_INTEGER, DWORD, DWORD, HANDLE, HANDLE, LPVOID data)
+    {
+      ((FileCopier*)data)->Progress(transferred.QuadPart);
+      return PROGRESS_CONTINUE;
+    }
+    void Progress(UINT64 bytes)
+    {
+      // At most one progress packet is outstanding, and none are posted
+      // more often than every ProgressInterval milliseconds.
+      if (0 == ProgressInterval)
+        return;
+      DWORD now = ::GetTickCount();
+      if ((now - LastProgress) < ProgressInterval)
+        return;
+      if (InterlockedCompareExchange(&ProgressPending, 1, 0) != 0)
+        return;
+      LastProgress = now;
+      ProgressBytes = bytes;
+      PostIOComplete(0, ProgressComplete, (LPOVERLAPPED)this);
+    }
+    static ptr ProgressComplete(DWORD, LPOVERLAPPED overlapped, DWORD)
+    {
+      // Completion packets are dequeued in order, so this runs before
+      // the final packet deletes the FileCopier.
+      FileCopier* copier = (FileCopier*)overlapped;
+      ptr r = MakeList(copier->Callback, Sunsigned64(copier->ProgressBytes));
+      InterlockedExchange(&copier->ProgressPending, 0);
+      return r;
+    }
+    virtual ptr GetResult()
+    {
+      if (0 == Hash)
+        return Strue;
+      return MakeHashValue(Hash);
+    }
+  };
+
+  if (!Sstringp(existingPath) || !Sstringp(newPath) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::CopyFile", ERROR_BAD_ARGUMENTS);
+  HCRYPTHASH hash = 0;
+  if (0 != alg)
+  {
+    ptr r = CreateHash(alg, hash);
+    if (Spairp(r))
+      return r;
+  }
+  WideString wexistingPath(existingPath);
+  WideString wnewPath(newPath);
+  return StartWorker(new FileCopier(wexistingPath.GetDetachedBuffer(), wnewPath.GetDetachedBuffer(), flags, hash, progressInterval, callback));
+}
+
+ptr osi::WalkDirectory(ptr root, ptr patterns, int maxDepth, UINT batchSize, ptr callback)
+{
+  struct WalkEntry
+  {
+    std::wstring Path;
+    UINT64 Size;
+    INT64 LastWriteTime;
+    bool IsDirectory;
+    const char* ErrorWho;
+    DWORD Error;
+  };
+  struct PendingDirectory
+  {
+    std::wstring Path;
+    int Depth;
+  };
+  class WalkBatch
+  {
+  public:
+    ptr Callback;
+    std::vector<WalkEntry> Entries;
+    static ptr Complete(DWORD, LPOVERLAPPED overlapped, DWORD)
+    {
+      WalkBatch* batch = (WalkBatch*)overlapped;
+      ptr callback = batch->Callback;
+      ptr result = Snil;
+      std::vector<WalkEntry>::reverse_iterator iter = batch->Entries.rbegin();
+      for (; iter != batch->Entries.rend(); iter++)
+      {
+        ptr path = MakeSchemeString(iter->Path.c_str());
+        if (Spairp(path))
+          continue;
+        ptr x;
+        if (0 != iter->Error)
+          x = Scons(path, MakeErrorPair(iter->ErrorWho, iter->Error));
+        else
+        {
+          x = Smake_vector(4, Sfalse);
+          Svector_set(x, 0, path);
+          Svector_set(x, 1, Sunsigned64(iter->Size));
+          Svector_set(x, 2, Sinteger64(iter->LastWriteTime));
+          Svector_set(x, 3, Sboolean(iter->IsDirectory));
+        }
+        result = Scons(x, result);
+      }
+      delete batch;
+      return MakeList(callback, result);
+    }
+  };
+  class DirectoryWalker
+  {
+  public:
+    // Workers share one queue of directories, so at most MaxWorkers
+    // pool threads are busy no matter how wide the tree is.
+    enum { MaxWorkers = 8 };
+    std::wstring Root;
+    std::vector<std::wstring> Patterns;
+    int MaxDepth;
+    size_t BatchSize;
+    ptr Callback;
+    CRITICAL_SECTION Lock;
+    std::deque<PendingDirectory> Pending;
+    int Active;
+    WalkBatch* Batch;
+    const char* RootErrorWho;
+    DWORD RootError;
+    DirectoryWalker(const wchar_t* root, int maxDepth, size_t batchSize, ptr callback)
+    {
+      Root = root;
+      // Drop trailing separators so that entry paths can be appended.
+      while ((Root.size() > 1) && ((L'\\' == Root.back()) || (L'/' == Root.back())) && (L':' != Root[Root.size() - 2]))
+        Root.pop_back();
+      MaxDepth = maxDepth;
+      BatchSize = batchSize;
+      Callback = callback;
+      Slock_object(Callback);
+      InitializeCriticalSection(&Lock);
+      Active = 0;
+      Batch = NULL;
+      RootErrorWho = NULL;
+      RootError = 0;
+      PendingDirectory dir;
+      dir.Depth = 0;
+      Pending.push_back(dir);
+    }
+    ~DirectoryWalker()
+    {
+      DeleteCriticalSection(&Lock);
+      Sunlock_object(Callback);
+    }
+    // StartWorker must be called with Lock held.
+    bool StartWorker()
+    {
+      Active++;
+      if (!QueueUserWorkItem(WorkerMain, this, WT_EXECUTELONGFUNCTION))
+      {
+        Active--;
+        return false;
+      }
+      return true;
+    }
+    static DWORD WINAPI WorkerMain(PVOID parameter)
+    {
+      ((DirectoryWalker*)parameter)->Run();
+      return 0;
+    }
+    void Run()
+    {
+      for (;;)
+      {
+        EnterCriticalSection(&Lock);
+        if (Pending.empty())
+        {
+          bool done = (0 == --Active);
+          if (done)
+            PostBatch();
+          LeaveCriticalSection(&Lock);
+          // Every batch has been posted, so the final packet is
+          // dequeued after all of them.
+          if (done)
+            PostIOComplete(0, Complete, (LPOVERLAPPED)this);
+          return;
+        }
+        PendingDirectory dir = Pending.front();
+        Pending.pop_front();
+        LeaveCriticalSection(&Lock);
+        std::vector<WalkEntry> entries;
+        std::vector<PendingDirectory> subdirs;
+        Scan(dir, entries, subdirs);
+        EnterCriticalSection(&Lock);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+          if (NULL == Batch)
+          {
+            Batch = new WalkBatch;
+            Batch->Callback = Callback;
+          }
+          Batch->Entries.push_back(entries[i]);
+          if (Batch->Entries.size() >= BatchSize)
+            PostBatch();
+        }
+        for (size_t i = 0; i < subdirs.size(); i++)
+          Pending.push_back(subdirs[i]);
+        while ((Active < MaxWorkers) && (Pending.size() > (size_t)Active))
+          if (!StartWorker())
+            break;
+        LeaveCriticalSection(&Lock);
+      }
+    }
+    // PostBatch must be called with Lock held.
+    void PostBatch()
+    {
+      if (NULL != Batch)
+      {
+        PostIOComplete(0, WalkBatch::Complete, (LPOVERLAPPED)Batch);
+        Batch = NULL;
+      }
+    }
+    bool Matches(const wchar_t* name)
+    {
+      if (Patterns.empty())
+        return true;
+      for (size_t i = 0; i < Patterns.size(); i++)
+        if (PathMatchSpecW(name, Patterns[i].c_str()))
+          return true;
+      return false;
+    }
+    void Scan(const PendingDirectory& dir, std::vector<WalkEntry>& entries, std::vector<PendingDirectory>& subdirs)
+    {
+      std::wstring spec = Root;
+      if (!dir.Path.empty())
+      {
+        spec += L'\\';
+        spec += dir.Path;
+      }
+      spec += L"\\*";
+      WIN32_FIND_DATAW data;
+      HANDLE h = FindFirstFileExW(spec.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+      if (INVALID_HANDLE_VALUE == h)
+      {
+        AddError(dir, "FindFirstFileExW", GetLastError(), entries);
+        return;
+      }
+      do
+      {
+        const wchar_t* name = data.cFileName;
+        if (('.' == name[0]) && ((0 == name[1]) || (('.' == name[1]) && (0 == name[2]))))
+          continue;
+        bool isDirectory = (0 != (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY));
+        if (!isDirectory && !Matches(name))
+          continue;
+        WalkEntry entry;
+        entry.Path = dir.Path.empty() ? std::wstring(name) : (dir.Path + L'\\' + name);
+        entry.Size = ((UINT64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        entry.LastWriteTime = FileTimeToMilliseconds(data.ftLastWriteTime);
+        entry.IsDirectory = isDirectory;
+        entry.ErrorWho = NULL;
+        entry.Error = 0;
+        entries.push_back(entry);
+        // Do not follow junctions or symbolic links, which may form
+        // cycles.
+        if (isDirectory &&
+          (0 == (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) &&
+          ((MaxDepth < 0) || (dir.Depth < MaxDepth)))
+        {
+          PendingDirectory sub;
+          sub.Path = entry.Path;
+          sub.Depth = dir.Depth + 1;
+          subdirs.push_back(sub);
+        }
+      } while (FindNextFileW(h, &data));
+      DWORD error = GetLastError();
+      FindClose(h);
+      if (ERROR_NO_MORE_FILES != error)
+        AddError(dir, "FindNextFileW", error, entries);
+    }
+    void AddError(const PendingDirectory& dir, const char* who, DWORD error, std::vector<WalkEntry>& entries)
+    {
+      if (dir.Path.empty())
+      {
+        // Lock is not needed because no other worker runs until the
+        // root has been scanned.
+        RootErrorWho = who;
+        RootError = error;
+        return;
+      }
+      WalkEntry entry;
+      entry.Path = dir.Path;
+      entry.Size = 0;
+      entry.LastWriteTime = 0;
+      entry.IsDirectory = true;
+      entry.ErrorWho = who;
+      entry.Error = error;
+      entries.push_back(entry);
+    }
+    static ptr Complete(DWORD, LPOVERLAPPED overlapped, DWORD)
+    {
+      DirectoryWalker* walker = (DirectoryWalker*)overlapped;
+      ptr callback = walker->Callback;
+      ptr result = (0 == walker->RootError) ? Strue : MakeErrorPair(walker->RootErrorWho, walker->RootError);
+      delete walker;
+      return MakeList(callback, result);
+    }
+  };
+
+  if (!Sstringp(root) || !Sprocedurep(callback) || (0 == batchSize))
+    return MakeErrorPair("osi::WalkDirectory", ERROR_BAD_ARGUMENTS);
+  for (ptr ls = patterns; ls != Snil; ls = Scdr(ls))
+    if (!Spairp(ls) || !Sstringp(Scar(ls)))
+      return MakeErrorPair("osi::WalkDirectory", ERROR_BAD_ARGUMENTS);
+  WideString wroot(root);
+  DirectoryWalker* walker = new DirectoryWalker(wroot.GetBuffer(), maxDepth, batchSize, callback);
+  for (ptr ls = patterns; ls != Snil; ls = Scdr(ls))
+  {
+    WideString wpattern(Scar(ls));
+    walker->Patterns.push_back(wpattern.GetBuffer());
+  }
+  EnterCriticalSection(&walker->Lock);
+  bool started = walker->StartWorker();
+  DWORD error = GetLastError();
+  LeaveCriticalSection(&walker->Lock);
+  if (!started)
+  {
+    delete walker;
+    return MakeErrorPair("QueueUserWorkItem", error);
+  }
+  return Strue;
+}
+
+ptr osi::GetFileInfo(ptr paths, ptr callback)
+{
+  struct FileInfo
+  {
+    wchar_t* Path;
+    DWORD Error;
+    WIN32_FILE_ATTRIBUTE_DATA Data;
+  };
+  class FileInfoGetter : public WorkItem
+  {
+  public:
+    std::vector<FileInfo> Info;
+    ptr Callback;
+    FileInfoGetter(ptr callback)
+    {
+      Callback = callback;
+      Slock_object(Callback);
+    }
+    virtual ~FileInfoGetter()
+    {
+      for (std::vector<FileInfo>::iterator iter = Info.begin(); iter != Info.end(); iter++)
+        delete [] iter->Path;
+      Sunlock_object(Callback);
+    }
+    void Add(wchar_t* path)
+    {
+      FileInfo info;
+      info.Path = path;
+      info.Error = 0;
+      Info.push_back(info);
+    }
+    virtual DWORD Work()
+    {
+      for (std::vector<FileInfo>::iterator iter = Info.begin(); iter != Info.end(); iter++)
+        if (!GetFileAttributesExW(iter->Path, GetFileExInfoStandard, &iter->Data))
+          iter->Error = GetLastError();
+      return 0;
+    }
+    virtual ptr GetCompletionPacket(DWORD)
+    {
+      ptr callback = Callback;
+      ptr result = Smake_vector((iptr)Info.size(), Sfalse);
+      for (size_t i = 0; i < Info.size(); i++)
+      {
+        const FileInfo& info = Info[i];
+        if (0 != info.Error)
+          Svector_set(result, i, MakeErrorPair("GetFileAttributesExW", info.Error));
+        else
+        {
+          UINT64 size = ((UINT64)info.Data.nFileSizeHigh << 32) | info.Data.nFileSizeLow;
+          INT64 mtime = FileTimeToMilliseconds(info.Data.ftLastWriteTime);
+          ptr x = Smake_vector(3, Sfalse);
+          Svector_set(x, 0, Sunsigned(info.Data.dwFileAttributes));
+          Svector_set(x, 1, Sunsigned64(size));
+          Svector_set(x, 2, Sinteger64(mtime));
+          Svector_set(result, i, x);
+        }
+      }
+      delete this;
+      return MakeList(callback, result);
+    }
+  };
+
+  if (!Svectorp(paths) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::GetFileInfo", ERROR_BAD_ARGUMENTS);
+  iptr n = Svector_length(paths);
+  for (iptr i = 0; i < n; i++)
+    if (!Sstringp(Svector_ref(paths, i)))
+      return MakeErrorPair("osi::GetFileInfo", ERROR_BAD_ARGUMENTS);
+  FileInfoGetter* getter = new FileInfoGetter(callback);
+  for (iptr i = 0; i < n; i++)
+  {
+    WideString wpath(Svector_ref(paths, i));
+    getter->Add(wpath.GetDetachedBuffer());
+  }
+  return StartWorker(getter);
+}
+
+class ChangesRequest;
+
+typedef HandleMap<ChangesRequest*, 32801> WatcherMap;
+WatcherMap g_Watchers;
+
+class ChangesRequest
+{
+public:
+  OVERLAPPED Overlapped;
+  HANDLE Handle;
+  iptr SchemeHandle;
+  bool Subtree;
+  int RefCount;
+  FILE_NOTIFY_INFORMATION* Buffer;
+  static const size_t BufferSize = 65536;
+  ptr Callback;
+  ChangesRequest(HANDLE handle, bool subtree, ptr callback)
+  {
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Handle = handle;
+    SchemeHandle = g_Watchers.Allocate(this);
+    Subtree = subtree;
+    RefCount = 1;
+    Buffer = (FILE_NOTIFY_INFORMATION*)malloc(BufferSize);
+    Callback = callback;
+    Slock_object(Callback);
+  }
+  ~ChangesRequest()
+  {
+    Sunlock_object(Callback);
+    free(Buffer);
+  }
+  void Close()
+  {
+    CloseHandle(Handle);
+    Handle = INVALID_HANDLE_VALUE;
+    g_Watchers.Deallocate(SchemeHandle);
+    Release();
+  }
+  void AddRef()
+  {
+    RefCount++;
+  }
+  void Release()
+  {
+    if (--RefCount == 0)
+      delete this;
+  }
+  DWORD ReadDirectoryChanges()
+  {
+    DWORD n;
+    if (!ReadDirectoryChangesW(Handle, Buffer, BufferSize, Subtree, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, &n, &Overlapped, NULL))
+      return GetLastError();
+    else
+    {
+      AddRef();
+      return 0;
+    }
+  }
+  void ReadNext()
+  {
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+      AddRef();
+      PostIOComplete(0, Error, &Overlapped);
+    }
+    else
+    {
+      DWORD rc = ReadDirectoryChanges();
+      if (0 != rc)
+      {
+        AddRef();
+        PostIOComplete(rc, Error, &Overlapped);
+      }
+    }
+  }
+  ptr ToScheme(DWORD count, DWORD error)
+  {
+    if (0 == count) return Sunsigned(error);
+    std::vector<FILE_NOTIFY_INFORMATION*> data;
+    FILE_NOTIFY_INFORMATION* p = Buffer;
+    DWORD offset;
+    while (1)
+    {
+      data.push_back(p);
+      offset = p->NextEntryOffset;
+      if (0 == offset) break;
+      p = (FILE_NOTIFY_INFORMATION*)((iptr)p + offset);
+    }
+    ptr r = Snil;
+    std::vector<FILE_NOTIFY_INFORMATION*>::reverse_iterator iter = data.rbegin();
+    for (; iter != data.rend(); iter++)
+    {
+      p = *iter;
+      r = Scons(Scons(Sfixnum(p->Action), MakeSchemeString(p->FileName, p->FileNameLength)), r);
+    }
+    return r;
+  }
+  static ptr Complete(DWORD count, LPOVERLAPPED overlapped, DWORD error)
+  {
+    ChangesRequest* req = (ChangesRequest*)((size_t)overlapped - offsetof(ChangesRequest, Overlapped));
+    ptr callback = req->Callback;
+    ptr r = req->ToScheme(count, error);
+    if (0 != count)
+      req->ReadNext();
+    req->Release();
+    return MakeList(callback, r);
+  }
+  static ptr Error(DWORD count, LPOVERLAPPED overlapped, DWORD)
+  {
+    ChangesRequest* req = (ChangesRequest*)((size_t)overlapped - offsetof(ChangesRequest, Overlapped));
+    ptr callback = req->Callback;
+    req->Release();
+    return MakeList(callback, Sunsigned(count));
+  }
+};
+
+ptr osi::WatchDirectory(ptr path, bool subtree, ptr callback)
+{
+  if (!Sstringp(path) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::WatchDirectory", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  HANDLE h = ::CreateFileW(wpath.GetBuffer(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (INVALID_HANDLE_VALUE == h)
+    return MakeLastErrorPair("CreateFileW");
+  if (CreateIoCompletionPort(h, g_CompletionPort, (ULONG_PTR)ChangesRequest::Complete, 0) == NULL)
+  {
+    DWORD error = GetLastError();
+    CloseHandle(h);
+    return MakeErrorPair("CreateIoCompletionPort", error);
+  }
+  ChangesRequest* req = new ChangesRequest(h, subtree, callback);
+  DWORD rc = req->ReadDirectoryChanges();
+  if (0 == rc)
+    return Sfixnum(req->SchemeHandle);
+  else
+  {
+    req->Close();
+    return MakeErrorPair("ReadDirectoryChangesW", rc);
+  }
+}
+
+ptr osi::CloseDirectoryWatcher(iptr watcher)
+{
+  static ChangesRequest* missing = NULL;
+  ChangesRequest* req = g_Watchers.Lookup(watcher, missing);
+  if (NULL == req)
+    return MakeErrorPair("osi::CloseDirectoryWatcher", ERROR_INVALID_HANDLE);
+  req->Close();
+  return Strue;
+}
+
+struct MappedView
+{
+  const BYTE* Data;
+  UINT64 Size;
+};
+
+typedef HandleMap<MappedView*, 32713> MappingMap;
+MappingMap g_Mappings;
+
+static inline MappedView* LookupMapping(iptr mapping)
+{
+  static MappedView* missing = NULL;
+  return g_Mappings.Lookup(mapping, missing);
+}
+
+// The view may be backed by a network volume, so reading it can raise
+// EXCEPTION_IN_PAGE_ERROR. These helpers have no objects to unwind so
+// that they can use structured exception handling.
+
+static DWORD CopyMapped(void* to, const void* from, size_t n)
+{
+  __try
+  {
+    memcpy(to, from, n);
+  }
+  __except (EXCEPTION_IN_PAGE_ERROR == GetExceptionCode() ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+  {
+    return ERROR_READ_FAULT;
+  }
+  return 0;
+}
+
+static DWORD CompareMapped(const void* x, const void* y, size_t n, int& result)
+{
+  __try
+  {
+    result = memcmp(x, y, n);
+  }
+  __except (EXCEPTION_IN_PAGE_ERROR == GetExceptionCode() ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+  {
+    return ERROR_READ_FAULT;
+  }
+  return 0;
+}
+
+static DWORD SearchMapped(const BYTE* data, size_t n, const BYTE* pattern, size_t m, const BYTE*& result)
+{
+  result = NULL;
+  __try
+  {
+    const BYTE* last = data + (n - m);
+    for (const BYTE* p = data; p <= last; p++)
+    {
+      p = (const BYTE*)memchr(p, pattern[0], last - p + 1);
+      if (NULL == p)
+        break;
+      if (memcmp(p, pattern, m) == 0)
+      {
+        result = p;
+        break;
+      }
+    }
+  }
+  __except (EXCEPTION_IN_PAGE_ERROR == GetExceptionCode() ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+  {
+    return ERROR_READ_FAULT;
+  }
+  return 0;
+}
+
+ptr osi::MapFile(ptr path)
+{
+  if (!Sstringp(path))
+    return MakeErrorPair("osi::MapFile", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  HANDLE h = ::CreateFileW(wpath.GetBuffer(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (INVALID_HANDLE_VALUE == h)
+    return MakeLastErrorPair("CreateFileW");
+  UINT64 size;
+  if (GetFileSizeEx(h, (PLARGE_INTEGER)&size) == 0)
+  {
+    DWORD error = GetLastError();
+    CloseHandle(h);
+    return MakeErrorPair("GetFileSizeEx", error);
+  }
+  const BYTE* data = NULL;
+  // An empty file cannot be mapped, so it gets a view with no data.
+  if (0 != size)
+  {
+    HANDLE m = CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (NULL == m)
+    {
+      DWORD error = GetLastError();
+      CloseHandle(h);
+      return MakeErrorPair("CreateFileMappingW", error);
+    }
+    data = (const BYTE*)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    DWORD error = GetLastError();
+    // The view keeps the mapping and file open until it is unmapped.
+    CloseHandle(m);
+    if (NULL == data)
+    {
+      CloseHandle(h);
+      return MakeErrorPair("MapViewOfFile", error);
+    }
+  }
+  CloseHandle(h);
+  MappedView* view = new MappedView;
+  view->Data = data;
+  view->Size = size;
+  return Sfixnum(g_Mappings.Allocate(view));
+}
+
+ptr osi::UnmapFile(iptr mapping)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::UnmapFile", ERROR_INVALID_HANDLE);
+  if (NULL != view->Data)
+    UnmapViewOfFile(view->Data);
+  delete view;
+  g_Mappings.Deallocate(mapping);
+  return Strue;
+}
+
+ptr osi::GetMappingSize(iptr mapping)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::GetMappingSize", ERROR_INVALID_HANDLE);
+  return Sunsigned64(view->Size);
+}
+
+ptr osi::GetMappingAddress(iptr mapping)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::GetMappingAddress", ERROR_INVALID_HANDLE);
+  return Sunsigned((uptr)view->Data);
+}
+
+ptr osi::ReadMapping(iptr mapping, UINT64 offset, ptr buffer, size_t startIndex, UINT32 size)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::ReadMapping", ERROR_INVALID_HANDLE);
+  size_t last = startIndex + size;
+  if (!Sbytevectorp(buffer) ||
+      (last < startIndex) || // startIndex + size overflowed
+      (last > static_cast<size_t>(Sbytevector_length(buffer))))
+    return MakeErrorPair("osi::ReadMapping", ERROR_BAD_ARGUMENTS);
+  if (offset >= view->Size)
+    return Sfixnum(0);
+  if (size > view->Size - offset)
+    size = static_cast<UINT32>(view->Size - offset);
+  DWORD error = CopyMapped(&Sbytevector_u8_ref(buffer, startIndex), view->Data + offset, size);
+  if (0 != error)
+    return MakeErrorPair("osi::ReadMapping", error);
+  return Sunsigned(size);
+}
+
+ptr osi::CompareMapping(iptr mapping, UINT64 offset, ptr buffer, size_t startIndex, UINT32 size)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::CompareMapping", ERROR_INVALID_HANDLE);
+  size_t last = startIndex + size;
+  if (!Sbytevectorp(buffer) ||
+      (last < startIndex) || // startIndex + size overflowed
+      (last > static_cast<size_t>(Sbytevector_length(buffer))) ||
+      (offset > view->Size) ||
+      (size > view->Size - offset))
+    return MakeErrorPair("osi::CompareMapping", ERROR_BAD_ARGUMENTS);
+  int result = 0;
+  DWORD error = CompareMapped(view->Data + offset, &Sbytevector_u8_ref(buffer, startIndex), size, result);
+  if (0 != error)
+    return MakeErrorPair("osi::CompareMapping", error);
+  return Sfixnum((result < 0) ? -1 : (result > 0) ? 1 : 0);
+}
+
+ptr osi::SearchMapping(iptr mapping, UINT64 offset, ptr pattern)
+{
+  MappedView* view = LookupMapping(mapping);
+  if (NULL == view)
+    return MakeErrorPair("osi::SearchMapping", ERROR_INVALID_HANDLE);
+  if (!Sbytevectorp(pattern) || (Sbytevector_length(pattern) == 0))
+    return MakeErrorPair("osi::SearchMapping", ERROR_BAD_ARGUMENTS);
+  size_t m = Sbytevector_length(pattern);
+  if ((offset > view->Size) || (m > view->Size - offset))
+    return Sfalse;
+  const BYTE* found;
+  DWORD error = SearchMapped(view->Data + offset, static_cast<size_t>(view->Size - offset), Sbytevector_data(pattern), m, found);
+  if (0 != error)
+    return MakeErrorPair("osi::SearchMapping", error);
+  if (NULL == found)
+    return Sfalse;
+  return Sunsigned64(found - view->Data);
+}
+
+// The file cache keeps the contents of recently used files in native
+// memory so that they can be written to sockets without reading the
+// files again. Entries are keyed by lowercase full path and evicted in
+// least-recently-used order when the byte limit is exceeded. The cache
+// is only used from the Scheme thread; the caller is responsible for
+// invalidating entries when files change.
+
+typedef std::list<std::pair<std::wstring, SharedBuffer*> > CachedFileList;
+typedef std::unordered_map<std::wstring, CachedFileList::iterator> CachedFileIndex;
+
+static CachedFileList g_CacheEntries; // most recently used first
+static CachedFileIndex g_CacheIndex;
+static size_t g_CacheLimit = 0;
+static size_t g_CacheMaxFileSize = 0;
+static size_t g_CacheBytesUsed = 0;
+static UINT64 g_CacheHits = 0;
+static UINT64 g_CacheMisses = 0;
+static UINT64 g_CacheEvictions = 0;
+static UINT64 g_CacheGeneration = 0;
+
+typedef HandleMap<SharedBuffer*, 32717> CachedFileMap;
+CachedFileMap g_CachedFiles;
+
+static inline SharedBuffer* LookupCachedFile(iptr file)
+{
+  static SharedBuffer* missing = NULL;
+  return g_CachedFiles.Lookup(file, missing);
+}
+
+static std::wstring MakeCacheKey(const wchar_t* path)
+{
+  std::wstring key(path);
+  if (!key.empty())
+    CharLowerBuffW(&key[0], static_cast<DWORD>(key.size()));
+  return key;
+}
+
+static void RemoveCachedFile(CachedFileList::iterator entry)
+{
+  g_CacheBytesUsed -= entry->second->Size;
+  entry->second->Release();
+  g_CacheIndex.erase(entry->first);
+  g_CacheEntries.erase(entry);
+}
+
+static void TrimFileCache()
+{
+  while (!g_CacheEntries.empty() && (g_CacheBytesUsed > g_CacheLimit))
+  {
+    RemoveCachedFile(--g_CacheEntries.end());
+    g_CacheEvictions++;
+  }
+}
+
+static void InsertCachedFile(const std::wstring& key, SharedBuffer* content)
+{
+  if ((content->Size > g_CacheLimit) || (content->Size > g_CacheMaxFileSize))
+    return;
+  CachedFileIndex::iterator found = g_CacheIndex.find(key);
+  if (g_CacheIndex.end() != found)
+    RemoveCachedFile(found->second);
+  content->AddRef();
+  g_CacheEntries.push_front(std::make_pair(key, content));
+  g_CacheIndex[key] = g_CacheEntries.begin();
+  g_CacheBytesUsed += content->Size;
+  TrimFileCache();
+}
+
+ptr osi::SetFileCacheLimit(size_t limit, size_t maxFileSize)
+{
+  g_CacheLimit = limit;
+  g_CacheMaxFileSize = maxFileSize;
+  TrimFileCache();
+  return Strue;
+}
+
+ptr osi::OpenCachedFile(ptr path, ptr callback)
+{
+  class CachedFileLoader : public PathWorker
+  {
+  public:
+    std::wstring Key;
+    size_t MaxFileSize;
+    UINT64 Generation;
+    SharedBuffer* Content;
+    CachedFileLoader(wchar_t* path, const std::wstring& key, size_t maxFileSize, SharedBuffer* content, ptr callback) : PathWorker(path, NULL, callback, NULL)
+    {
+      Key = key;
+      MaxFileSize = maxFileSize;
+      Generation = g_CacheGeneration;
+      Content = content;
+    }
+    virtual ~CachedFileLoader()
+    {
+      if (NULL != Content)
+        Content->Release();
+    }
+    virtual DWORD Work()
+    {
+      HANDLE h = ::CreateFileW(Path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (INVALID_HANDLE_VALUE == h)
+      {
+        ErrorWho = "CreateFileW";
+        return GetLastError();
+      }
+      DWORD error = 0;
+      UINT64 size;
+      if (GetFileSizeEx(h, (PLARGE_INTEGER)&size) == 0)
+      {
+        ErrorWho = "GetFileSizeEx";
+        error = GetLastError();
+      }
+      else if (size > MaxFileSize)
+      {
+        ErrorWho = "osi::OpenCachedFile";
+        error = ERROR_FILE_TOO_LARGE;
+      }
+      else
+      {
+        Content = new SharedBuffer(static_cast<size_t>(size));
+        size_t offset = 0;
+        while (offset < Content->Size)
+        {
+          size_t remaining = Content->Size - offset;
+          DWORD n;
+          if (!ReadFile(h, Content->Data + offset, (remaining > 0x40000000) ? 0x40000000 : static_cast<DWORD>(remaining), &n, NULL))
+          {
+            ErrorWho = "ReadFile";
+            error = GetLastError();
+            break;
+          }
+          if (0 == n)
+          {
+            // The file was truncated after its size was read.
+            ErrorWho = "ReadFile";
+            error = ERROR_HANDLE_EOF;
+            break;
+          }
+          offset += n;
+        }
+      }
+      CloseHandle(h);
+      return error;
+    }
+    virtual ptr GetResult()
+    {
+      // Content read before the most recent invalidation may be stale,
+      // so it is returned to the caller but not cached.
+      if ((NULL != Path) && (g_CacheGeneration == Generation))
+        InsertCachedFile(Key, Content);
+      // The handle takes over the loader's reference.
+      ptr result = Sfixnum(g_CachedFiles.Allocate(Content));
+      Content = NULL;
+      return result;
+    }
+  };
+
+  if (!Sstringp(path) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::OpenCachedFile", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  std::wstring key = MakeCacheKey(wpath.GetBuffer());
+  CachedFileIndex::iterator found = g_CacheIndex.find(key);
+  if (g_CacheIndex.end() != found)
+  {
+    CachedFileList::iterator entry = found->second;
+    g_CacheHits++;
+    g_CacheEntries.splice(g_CacheEntries.begin(), g_CacheEntries, entry);
+    entry->second->AddRef();
+    // A hit completes through the completion port like a miss does, but
+    // without a trip to a worker thread.
+    WorkItem* item = new CachedFileLoader(NULL, key, 0, entry->second, callback);
+    PostIOComplete(0, WorkItem::Complete, (LPOVERLAPPED)item);
+    return Strue;
+  }
+  g_CacheMisses++;
+  return StartWorker(new CachedFileLoader(wpath.GetDetachedBuffer(), key, g_CacheMaxFileSize, NULL, callback));
+}
+
+ptr osi::CloseCachedFile(iptr file)
+{
+  SharedBuffer* content = LookupCachedFile(file);
+  if (NULL == content)
+    return MakeErrorPair("osi::CloseCachedFile", ERROR_INVALID_HANDLE);
+  content->Release();
+  g_CachedFiles.Deallocate(file);
+  return Strue;
+}
+
+ptr osi::GetCachedFileSize(iptr file)
+{
+  SharedBuffer* content = LookupCachedFile(file);
+  if (NULL == content)
+    return MakeErrorPair("osi::GetCachedFileSize", ERROR_INVALID_HANDLE);
+  return Sunsigned64(content->Size);
+}
+
+ptr osi::WriteCachedFile(iptr port, iptr file, size_t startIndex, UINT32 size, ptr callback)
+{
+  Port* p = LookupPort(port);
+  SharedBuffer* content = LookupCachedFile(file);
+  if ((NULL == p) || (NULL == content))
+    return MakeErrorPair("osi::WriteCachedFile", ERROR_INVALID_HANDLE);
+  size_t last = startIndex + size;
+  if ((last <= startIndex) || // size is 0 or startIndex + size overflowed
+      (last > content->Size) ||
+      !Sprocedurep(callback))
+    return MakeErrorPair("osi::WriteCachedFile", ERROR_BAD_ARGUMENTS);
+  return p->WriteShared(content, startIndex, size, callback);
+}
+
+ptr osi::InvalidateCachedFiles(ptr path)
+{
+  if (!Sstringp(path))
+    return MakeErrorPair("osi::InvalidateCachedFiles", ERROR_BAD_ARGUMENTS);
+  WideString wpath(path);
+  std::wstring key = MakeCacheKey(wpath.GetBuffer());
+  while (!key.empty() && ((L'\\' == key.back()) || (L'/' == key.back())))
+    key.pop_back();
+  g_CacheGeneration++;
+  size_t count = 0;
+  CachedFileList::iterator iter = g_CacheEntries.begin();
+  while (g_CacheEntries.end() != iter)
+  {
+    CachedFileList::iterator entry = iter++;
+    const std::wstring& name = entry->first;
+    // Remove the file itself and everything beneath it when it is a
+    // directory.
+    if ((name.compare(0, key.size(), key) == 0) &&
+        ((name.size() == key.size()) || (L'\\' == name[key.size()])))
+    {
+      RemoveCachedFile(entry);
+      count++;
+    }
+  }
+  return Sunsigned(count);
+}
+
+ptr osi::GetFileCacheStatistics()
+{
+  UINT64 lookups = g_CacheHits + g_CacheMisses;
+  ptr v = Smake_vector(8, Sfixnum(0));
+  Svector_set(v, 0, Sstring_to_symbol("<file-cache-statistics>"));
+  Svector_set(v, 1, Sunsigned64(g_CacheHits));
+  Svector_set(v, 2, Sunsigned64(g_CacheMisses));
+  Svector_set(v, 3, Sflonum((0 == lookups) ? 0.0 : static_cast<double>(g_CacheHits) / lookups));
+  Svector_set(v, 4, Sunsigned64(g_CacheEvictions));
+  Svector_set(v, 5, Sunsigned(g_CacheEntries.size()));
+  Svector_set(v, 6, Sunsigned(g_CacheBytesUsed));
+  Svector_set(v, 7, Sunsigned(g_CacheLimit));
+  return v;
 }
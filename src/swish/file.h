@@ -38,4 +38,28 @@ namespace osi
   ptr GetFullPath(ptr path);
   ptr WatchDirectory(ptr path, bool subtree, ptr callback);
   ptr CloseDirectoryWatcher(iptr watcher);
+  ptr CreateFileAsync(ptr name, UINT desiredAccess, UINT shareMode, UINT creationDisposition, ptr callback);
+  ptr DeleteFileAsync(ptr name, ptr callback);
+  ptr MoveFileAsync(ptr existingPath, ptr newPath, UINT flags, ptr callback);
+  ptr CreateDirectoryAsync(ptr path, ptr callback);
+  ptr RemoveDirectoryAsync(ptr path, ptr callback);
+  ptr GetDiskFreeSpaceAsync(ptr path, ptr callback);
+  ptr GetFullPathAsync(ptr path, ptr callback);
+  ptr GetFileInfo(ptr paths, ptr callback);
+  ptr CopyFile(ptr existingPath, ptr newPath, UINT flags, ALG_ID alg, UINT progressInterval, ptr callback);
+  ptr MapFile(ptr path);
+  ptr UnmapFile(iptr mapping);
+  ptr GetMappingSize(iptr mapping);
+  ptr GetMappingAddress(iptr mapping);
+  ptr ReadMapping(iptr mapping, UINT64 offset, ptr buffer, size_t startIndex, UINT32 size);
+  ptr CompareMapping(iptr mapping, UINT64 offset, ptr buffer, size_t startIndex, UINT32 size);
+  ptr SearchMapping(iptr mapping, UINT64 offset, ptr pattern);
+  ptr WalkDirectory(ptr root, ptr patterns, int maxDepth, UINT batchSize, ptr callback);
+  ptr SetFileCacheLimit(size_t limit, size_t maxFileSize);
+  ptr OpenCachedFile(ptr path, ptr callback);
+  ptr CloseCachedFile(iptr file);
+  ptr GetCachedFileSize(iptr file);
+  ptr WriteCachedFile(iptr port, iptr file, size_t startIndex, UINT32 size, ptr callback);
+  ptr InvalidateCachedFiles(ptr path);
+  ptr GetFileCacheStatistics();
 }
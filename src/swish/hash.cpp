@@ -39,16 +39,36 @@ static inline const HCRYPTHASH& LookupHash(iptr hash)
   return g_Hashes.Lookup(hash, missing);
 }
 
-ptr osi::OpenHash(ALG_ID alg)
+ptr CreateHash(ALG_ID alg, HCRYPTHASH& h)
 {
   if (NULL == g_CryptProvider)
   {
     if (!CryptAcquireContext(&g_CryptProvider, NULL, MS_ENH_RSA_AES_PROV, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
       return MakeLastErrorPair("CryptAcquireContextW");
   }
-  HCRYPTHASH h;
   if (!CryptCreateHash(g_CryptProvider, alg, 0, 0, &h))
     return MakeLastErrorPair("CryptCreateHash");
+  return Strue;
+}
+
+ptr MakeHashValue(HCRYPTHASH h)
+{
+  DWORD hashsize;
+  DWORD n = sizeof(hashsize);
+  if (!CryptGetHashParam(h, HP_HASHSIZE, (BYTE*)&hashsize, &n, 0))
+    return MakeLastErrorPair("CryptGetHashParam");
+  ptr r = Smake_bytevector(hashsize, 0);
+  if (!CryptGetHashParam(h, HP_HASHVAL, Sbytevector_data(r), &hashsize, 0))
+    return MakeLastErrorPair("CryptGetHashParam");
+  return r;
+}
+
+ptr osi::OpenHash(ALG_ID alg)
+{
+  HCRYPTHASH h;
+  ptr r = CreateHash(alg, h);
+  if (Spairp(r))
+    return r;
   return Sfixnum(g_Hashes.Allocate(h));
 }
 
@@ -72,14 +92,7 @@ ptr osi::GetHashValue(iptr hash)
   HCRYPTHASH h = LookupHash(hash);
   if (NULL == h)
     return MakeErrorPair("osi::GetHashValue", ERROR_INVALID_HANDLE);
-  DWORD hashsize;
-  DWORD n = sizeof(hashsize);
-  if (!CryptGetHashParam(h, HP_HASHSIZE, (BYTE*)&hashsize, &n, 0))
-    return MakeLastErrorPair("CryptGetHashParam");
-  ptr r = Smake_bytevector(hashsize, 0);
-  if (!CryptGetHashParam(h, HP_HASHVAL, Sbytevector_data(r), &hashsize, 0))
-    return MakeLastErrorPair("CryptGetHashParam");
-  return r;
+  return MakeHashValue(h);
 }
 
 ptr osi::CloseHash(iptr hash)
@@ -32,3 +32,7 @@ namespace osi
 
 typedef HandleMap<HCRYPTHASH, 32719> HashMap;
 extern HashMap g_Hashes;
+
+// CreateHash and MakeHashValue must be called from the Scheme thread.
+ptr CreateHash(ALG_ID alg, HCRYPTHASH& h);
+ptr MakeHashValue(HCRYPTHASH h);
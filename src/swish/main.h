@@ -122,20 +122,7 @@ class UTF8String
 public:
   UTF8String(ptr ss)
   {
-    Length = 1;
-    size_t n = Sstring_length(ss);
-    for (size_t i = 0; i < n; i++)
-    {
-      string_char c = Sstring_ref(ss, i);
-      if (c < 0x80)
-        Length += 1;
-      else if (c < 0x800)
-        Length += 2;
-      else if (c < 0x10000)
-        Length += 3;
-      else
-        Length += 4;
-    }
+    Length = GetEncodedLength(ss) + 1;
     char* utf8;
     if (Length <= sizeof(StackData))
     {
@@ -147,6 +134,41 @@ public:
       utf8 = new char[Length];
       HeapData = utf8;
     }
+    *Encode(ss, utf8) = 0;
+  }
+  ~UTF8String()
+  {
+    if (HeapData)
+      delete [] HeapData;
+  }
+  inline char* GetBuffer() { return HeapData ? HeapData : StackData; }
+  inline size_t GetLength() { return Length; }
+
+  // Returns the number of bytes needed to encode ss, excluding a
+  // terminating null.
+  static size_t GetEncodedLength(ptr ss)
+  {
+    size_t length = 0;
+    size_t n = Sstring_length(ss);
+    for (size_t i = 0; i < n; i++)
+    {
+      string_char c = Sstring_ref(ss, i);
+      if (c < 0x80)
+        length += 1;
+      else if (c < 0x800)
+        length += 2;
+      else if (c < 0x10000)
+        length += 3;
+      else
+        length += 4;
+    }
+    return length;
+  }
+
+  // Encodes ss at utf8 without a terminating null and returns the end.
+  static char* Encode(ptr ss, char* utf8)
+  {
+    size_t n = Sstring_length(ss);
     for (size_t i = 0; i < n; i++)
     {
       string_char c = Sstring_ref(ss, i);
@@ -171,15 +193,8 @@ public:
         *utf8++ = (c & 0x3F) | 0x80;
       }
     }
-    *utf8 = 0;
-  }
-  ~UTF8String()
-  {
-    if (HeapData)
-      delete [] HeapData;
+    return utf8;
   }
-  inline char* GetBuffer() { return HeapData ? HeapData : StackData; }
-  inline size_t GetLength() { return Length; }
 };
 
 class UTF16Buffer
@@ -52,6 +52,11 @@ public:
   virtual ptr Write(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition,
                    ptr callback) = 0;
   virtual ptr Close() = 0;
+  virtual ptr WriteShared(SharedBuffer* buffer, size_t startIndex, UINT32 size,
+                          ptr callback)
+  {
+    return MakeErrorPair("osi::WriteCachedFile", ERROR_INVALID_HANDLE);
+  }
   virtual ptr GetFileSize()
   {
     return MakeErrorPair("osi::GetFileSize", ERROR_INVALID_HANDLE);
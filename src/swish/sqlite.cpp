@@ -29,17 +29,55 @@ void sqlite_init()
   DEFINE_FOREIGN(osi::PrepareStatement);
   DEFINE_FOREIGN(osi::FinalizeStatement);
   DEFINE_FOREIGN(osi::BindStatement);
+  DEFINE_FOREIGN(osi::BindStatementAll);
   DEFINE_FOREIGN(osi::ClearStatementBindings);
   DEFINE_FOREIGN(osi::GetLastInsertRowid);
+  DEFINE_FOREIGN(osi::GetAutocommit);
   DEFINE_FOREIGN(osi::GetStatementColumns);
   DEFINE_FOREIGN(osi::GetStatementSQL);
   DEFINE_FOREIGN(osi::ResetStatement);
   DEFINE_FOREIGN(osi::StepStatement);
+  DEFINE_FOREIGN(osi::StepStatementN);
+  DEFINE_FOREIGN(osi::StepStatementColumnar);
+  DEFINE_FOREIGN(osi::StepStatementAsJSON);
+  DEFINE_FOREIGN(osi::StepStatementAsCSV);
+  DEFINE_FOREIGN(osi::ExecuteBatch);
+  DEFINE_FOREIGN(osi::AppendLog);
+  DEFINE_FOREIGN(osi::GetLogCount);
+  DEFINE_FOREIGN(osi::SetLogBufferLimit);
+  DEFINE_FOREIGN(osi::DrainLogs);
+  DEFINE_FOREIGN(osi::ConfigureSQLite);
+  DEFINE_FOREIGN(osi::SetSoftHeapLimit);
   DEFINE_FOREIGN(osi::GetSQLiteStatus);
+  DEFINE_FOREIGN(osi::GetStatementStatus);
+  DEFINE_FOREIGN(osi::GetDatabaseStatus);
+  DEFINE_FOREIGN(osi::SetSlowQueryTrace);
+  DEFINE_FOREIGN(osi::SetDatabaseTrace);
+  DEFINE_FOREIGN(osi::SetDatabaseTimeout);
+  DEFINE_FOREIGN(osi::InterruptDatabase);
+  DEFINE_FOREIGN(osi::SetDatabaseMemoryMap);
+  DEFINE_FOREIGN(osi::SetDatabaseCacheSize);
+  DEFINE_FOREIGN(osi::SetDatabaseLookaside);
+  DEFINE_FOREIGN(osi::StartBackup);
+  DEFINE_FOREIGN(osi::BackupStep);
+  DEFINE_FOREIGN(osi::FinishBackup);
+  DEFINE_FOREIGN(osi::CheckpointDatabase);
+  DEFINE_FOREIGN(osi::GetWalFrames);
+  DEFINE_FOREIGN(osi::SetAutoCheckpoint);
+  DEFINE_FOREIGN(osi::PrepareCachedStatement);
+  DEFINE_FOREIGN(osi::ReleaseCachedStatements);
+  DEFINE_FOREIGN(osi::SetStatementCacheLimit);
+  DEFINE_FOREIGN(osi::GetStatementCacheStatistics);
+  DEFINE_FOREIGN(osi::GetCachedStatements);
+  DEFINE_FOREIGN(osi::OpenBlob);
+  DEFINE_FOREIGN(osi::OpenCursor);
+  DEFINE_FOREIGN(osi::ReadCursor);
+  DEFINE_FOREIGN(osi::CloseCursor);
 }
 
 DatabaseMap g_Databases;
 StatementMap g_Statements;
+BackupMap g_Backups;
 
 static inline const DatabaseEntry& LookupDatabase(iptr database)
 {
@@ -47,9 +85,34 @@ static inline const DatabaseEntry& LookupDatabase(iptr database)
   return g_Databases.Lookup(database, missing);
 }
 
-static void SetDatabaseBusy(iptr database, bool busy)
+// Runs on worker threads every ProgressInterval virtual machine
+// instructions. Returning nonzero makes the step fail with
+// SQLITE_INTERRUPT.
+static const int ProgressInterval = 1000;
+
+static int CheckDeadline(void* context)
+{
+  DatabaseShared* shared = (DatabaseShared*)context;
+  ULONGLONG deadline = shared->deadline;
+  if ((0 == deadline) || (GetTickCount64() < deadline))
+    return 0;
+  shared->timedOut = 1;
+  return 1;
+}
+
+// Registering a WAL hook removes SQLite's autocheckpoint hook, so this
+// one checkpoints the same way unless autoCheckpoint is 0. It runs on
+// the thread that commits.
+static const LONG DefaultAutoCheckpoint = 1000;
+
+static int WalCommitted(void* context, sqlite3* db, const char* name, int frames)
 {
-  g_Databases.Map.find(database)->second.busy = busy;
+  DatabaseShared* shared = (DatabaseShared*)context;
+  shared->walFrames = frames;
+  LONG limit = shared->autoCheckpoint;
+  if ((limit > 0) && (frames >= limit))
+    sqlite3_wal_checkpoint_v2(db, name, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+  return SQLITE_OK;
 }
 
 static inline const StatementEntry& LookupStatement(iptr statement)
@@ -58,19 +121,608 @@ static inline const StatementEntry& LookupStatement(iptr statement)
   return g_Statements.Lookup(statement, missing);
 }
 
+static inline const BackupEntry& LookupBackup(iptr backup)
+{
+  static BackupEntry missing = {0};
+  return g_Backups.Lookup(backup, missing);
+}
+
+static void SetBackupBusy(iptr backup, bool busy)
+{
+  g_Backups.Map.find(backup)->second.busy = busy;
+}
+
+static int FinishBackupEntry(const BackupEntry& be)
+{
+  int rc = sqlite3_backup_finish(be.backup);
+  sqlite3_close(be.dest);
+  return rc;
+}
+
 static inline ptr MakeSQLiteErrorPair(const char* who, int rc)
 {
   return MakeErrorPair(who, rc + 600000000);
 }
 
+// A step stopped by the step timeout fails with ERROR_TIMEOUT so that it
+// can be told apart from one stopped by osi::InterruptDatabase.
+static ptr MakeStepErrorPair(bool timedOut, const char* who, int rc)
+{
+  if ((SQLITE_INTERRUPT == rc) && timedOut)
+    return MakeErrorPair(who, ERROR_TIMEOUT);
+  return MakeSQLiteErrorPair(who, rc);
+}
+
+// Work on a database connection. The connection counts the item as
+// pending from the time it is queued until its completion packet is
+// dequeued, and the synchronous functions are refused in the meantime.
+class DatabaseWorkItem : public WorkItem
+{
+public:
+  iptr Database;
+  bool TimedOut;
+  DatabaseWorkItem(iptr database)
+  {
+    Database = database;
+    TimedOut = false;
+    g_Databases.Map.find(Database)->second.pending++;
+  }
+  virtual ~DatabaseWorkItem()
+  {
+    g_Databases.Map.find(Database)->second.pending--;
+  }
+};
+
+// Each connection runs its work items in order on a dedicated thread,
+// which is created on first use. Connections are opened with
+// SQLITE_OPEN_NOMUTEX because only that thread, or the Scheme thread
+// while nothing is pending, uses them.
+class DatabaseThread
+{
+public:
+  DatabaseThread(DatabaseShared* shared)
+  {
+    Shared = shared;
+    Thread = NULL;
+    Stopping = false;
+    InitializeCriticalSection(&Lock);
+    Wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+  }
+  ~DatabaseThread()
+  {
+    if (NULL != Thread)
+    {
+      EnterCriticalSection(&Lock);
+      Stopping = true;
+      LeaveCriticalSection(&Lock);
+      SetEvent(Wake);
+      WaitForSingleObject(Thread, INFINITE);
+      CloseHandle(Thread);
+    }
+    CloseHandle(Wake);
+    DeleteCriticalSection(&Lock);
+  }
+  ptr Start(DatabaseWorkItem* item)
+  {
+    if ((NULL == Thread) &&
+        (NULL == (Thread = CreateThread(NULL, 0, ThreadMain, this, 0, NULL))))
+    {
+      DWORD error = GetLastError();
+      delete item;
+      return MakeErrorPair("CreateThread", error);
+    }
+    EnterCriticalSection(&Lock);
+    Queue.push_back(item);
+    LeaveCriticalSection(&Lock);
+    SetEvent(Wake);
+    return Strue;
+  }
+private:
+  DatabaseShared* Shared;
+  HANDLE Thread;
+  HANDLE Wake;
+  CRITICAL_SECTION Lock;
+  std::deque<DatabaseWorkItem*> Queue;
+  bool Stopping;
+
+  static DWORD WINAPI ThreadMain(LPVOID context)
+  {
+    ((DatabaseThread*)context)->Run();
+    return 0;
+  }
+  void Run()
+  {
+    for (;;)
+    {
+      DatabaseWorkItem* item = NULL;
+      EnterCriticalSection(&Lock);
+      if (!Queue.empty())
+      {
+        item = Queue.front();
+        Queue.pop_front();
+      }
+      bool stopping = Stopping;
+      LeaveCriticalSection(&Lock);
+      if (NULL != item)
+        RunItem(item);
+      else if (stopping)
+        return;
+      else
+        WaitForSingleObject(Wake, INFINITE);
+    }
+  }
+  void RunItem(DatabaseWorkItem* item)
+  {
+    // Each item gets its own step deadline.
+    UINT32 timeout = Shared->timeout;
+    Shared->timedOut = 0;
+    Shared->deadline = (0 == timeout) ? 0 : GetTickCount64() + timeout;
+    DWORD rc = item->Work();
+    Shared->deadline = 0;
+    item->TimedOut = (0 != Shared->timedOut);
+    PostIOComplete(rc, WorkItem::Complete, (LPOVERLAPPED)item);
+  }
+};
+
+static ptr StartDatabaseWorker(DatabaseWorkItem* item)
+{
+  return g_Databases.Map.find(item->Database)->second.thread->Start(item);
+}
+
+// A blob port streams one BLOB with sqlite3_blob_read and
+// sqlite3_blob_write directly between the Scheme bytevector and SQLite,
+// on the thread of its database. The file position is the offset in the
+// BLOB. Closing the database closes its blobs.
+class BlobPort;
+typedef std::list<BlobPort*> BlobPortList;
+static BlobPortList g_BlobPorts;
+
+class BlobPort : public Port
+{
+public:
+  sqlite3_blob* Blob;
+  iptr Database;
+  bool Writable;
+  BlobPort(sqlite3_blob* blob, iptr database, bool writable)
+  {
+    Blob = blob;
+    Database = database;
+    Writable = writable;
+    g_BlobPorts.push_back(this);
+  }
+  virtual ~BlobPort()
+  {
+    g_BlobPorts.remove(this);
+  }
+  virtual ptr Read(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+  {
+    return Start("osi::ReadPort", false, buffer, startIndex, size, filePosition, callback);
+  }
+  virtual ptr Write(ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+  {
+    if (!Writable)
+      return MakeErrorPair("osi::WritePort", ERROR_ACCESS_DENIED);
+    return Start("osi::WritePort", true, buffer, startIndex, size, filePosition, callback);
+  }
+  virtual ptr Close()
+  {
+    // The database is pending while this port has I/O in flight.
+    if ((NULL != Blob) && LookupDatabase(Database).pending)
+      return MakeErrorPair("osi::ClosePort", ERROR_ACCESS_DENIED);
+    if (NULL != Blob)
+      sqlite3_blob_close(Blob);
+    delete this;
+    return Strue;
+  }
+  virtual ptr GetFileSize()
+  {
+    if (NULL == Blob)
+      return MakeErrorPair("osi::GetFileSize", ERROR_INVALID_HANDLE);
+    return Sinteger(sqlite3_blob_bytes(Blob));
+  }
+private:
+  class BlobIO : public DatabaseWorkItem
+  {
+  public:
+    sqlite3_blob* Blob;
+    bool IsWrite;
+    ptr Buffer;
+    size_t StartIndex;
+    int Count;
+    int Offset;
+    ptr Callback;
+    BlobIO(sqlite3_blob* blob, iptr database, bool isWrite, ptr buffer, size_t startIndex, int count, int offset, ptr callback) : DatabaseWorkItem(database)
+    {
+      Blob = blob;
+      IsWrite = isWrite;
+      Buffer = buffer;
+      StartIndex = startIndex;
+      Count = count;
+      Offset = offset;
+      Callback = callback;
+      Slock_object(Buffer);
+      Slock_object(Callback);
+    }
+    virtual ~BlobIO()
+    {
+      Sunlock_object(Buffer);
+      Sunlock_object(Callback);
+    }
+    virtual DWORD Work()
+    {
+      void* data = &Sbytevector_u8_ref(Buffer, StartIndex);
+      if (IsWrite)
+        return sqlite3_blob_write(Blob, data, Count, Offset);
+      // A read at or past the end completes with a count of 0.
+      int available = sqlite3_blob_bytes(Blob) - Offset;
+      if (available <= 0)
+      {
+        Count = 0;
+        return SQLITE_OK;
+      }
+      if (Count > available)
+        Count = available;
+      return sqlite3_blob_read(Blob, data, Count, Offset);
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      ptr callback = Callback;
+      DWORD count = (SQLITE_OK == error) ? Count : 0;
+      DWORD code = (SQLITE_OK == error) ? 0 : error + 600000000;
+      delete this;
+      return MakeList(callback, Sunsigned(count), Sunsigned(code));
+    }
+  };
+  ptr Start(const char* who, bool isWrite, ptr buffer, size_t startIndex, UINT32 size, ptr filePosition, ptr callback)
+  {
+    if (NULL == Blob)
+      return MakeErrorPair(who, ERROR_INVALID_HANDLE);
+    if (!Sfixnump(filePosition) || (Sfixnum_value(filePosition) < 0) ||
+        (Sfixnum_value(filePosition) > MAXLONG) || (size > MAXLONG))
+      return MakeErrorPair(who, ERROR_BAD_ARGUMENTS);
+    return StartDatabaseWorker(new BlobIO(Blob, Database, isWrite, buffer, startIndex, static_cast<int>(size), static_cast<int>(Sfixnum_value(filePosition)), callback));
+  }
+};
+
+static void CloseBlobPorts(iptr database)
+{
+  for (BlobPortList::const_iterator iter = g_BlobPorts.begin(); iter != g_BlobPorts.end(); ++iter)
+    if ((database == (*iter)->Database) && (NULL != (*iter)->Blob))
+    {
+      sqlite3_blob_close((*iter)->Blob);
+      (*iter)->Blob = NULL;
+    }
+}
+
+// A column or parameter value copied out of the Scheme heap or out of
+// SQLite so that worker threads can use it.
+struct SQLiteValue
+{
+  int Type;
+  sqlite3_int64 Integer;
+  double Float;
+  std::string Bytes;
+};
+
+static bool IsBindable(ptr datum)
+{
+  if (Sbignump(datum))
+  {
+    // Raise the out-of-range condition before anything is allocated.
+    Sinteger64_value(datum);
+    return true;
+  }
+  return (Sfalse == datum) || Sfixnump(datum) || Sflonump(datum) ||
+    Sstringp(datum) || Sbytevectorp(datum);
+}
+
+static void CopyValue(ptr datum, SQLiteValue& v)
+{
+  if (Sfalse == datum)
+    v.Type = SQLITE_NULL;
+  else if (Sfixnump(datum) || Sbignump(datum))
+  {
+    v.Type = SQLITE_INTEGER;
+    v.Integer = Sinteger64_value(datum);
+  }
+  else if (Sflonump(datum))
+  {
+    v.Type = SQLITE_FLOAT;
+    v.Float = Sflonum_value(datum);
+  }
+  else if (Sstringp(datum))
+  {
+    UTF8String u8text(datum);
+    v.Type = SQLITE_TEXT;
+    v.Bytes.assign(u8text.GetBuffer(), u8text.GetLength() - 1);
+  }
+  else // bytevector
+  {
+    v.Type = SQLITE_BLOB;
+    v.Bytes.assign((const char*)Sbytevector_data(datum), Sbytevector_length(datum));
+  }
+}
+
+// Binds v with SQLITE_STATIC, so v must outlive the binding. Sets who
+// when the bind fails.
+static int BindValue(sqlite3_stmt* stmt, int index, const SQLiteValue& v, const char*& who)
+{
+  int rc;
+  switch (v.Type)
+  {
+  case SQLITE_NULL:
+    rc = sqlite3_bind_null(stmt, index);
+    if (SQLITE_OK != rc)
+      who = "sqlite3_bind_null";
+    break;
+  case SQLITE_INTEGER:
+    rc = sqlite3_bind_int64(stmt, index, v.Integer);
+    if (SQLITE_OK != rc)
+      who = "sqlite3_bind_int64";
+    break;
+  case SQLITE_FLOAT:
+    rc = sqlite3_bind_double(stmt, index, v.Float);
+    if (SQLITE_OK != rc)
+      who = "sqlite3_bind_double";
+    break;
+  case SQLITE_TEXT:
+    if (v.Bytes.size() > MAXLONG)
+      rc = SQLITE_TOOBIG;
+    else
+      rc = sqlite3_bind_text(stmt, index, v.Bytes.data(), (long)v.Bytes.size(), SQLITE_STATIC);
+    if (SQLITE_OK != rc)
+      who = "sqlite3_bind_text";
+    break;
+  default: // SQLITE_BLOB
+    if (v.Bytes.size() > MAXLONG)
+      rc = SQLITE_TOOBIG;
+    else
+      rc = sqlite3_bind_blob(stmt, index, v.Bytes.data(), (long)v.Bytes.size(), SQLITE_STATIC);
+    if (SQLITE_OK != rc)
+      who = "sqlite3_bind_blob";
+  }
+  return rc;
+}
+
+// Rows appended by osi::AppendLog wait here, packed, until
+// osi::DrainLogs moves them into a work item. Both run on the Scheme
+// thread, so the buffer needs no lock. Statements are identified by
+// their position in SQL and are prepared on the database thread, which
+// alone uses Prepared.
+struct LogRecord
+{
+  UINT32 Statement;
+  UINT32 Count;
+};
+
+static const size_t DefaultLogBufferLimit = 16 * 1024 * 1024;
+static const size_t LogStatementLimit = 256;
+
+struct LogBuffer
+{
+  std::vector<std::string> SQL;
+  std::unordered_map<std::string, UINT32> Index;
+  std::deque<LogRecord> Records;
+  std::deque<SQLiteValue> Values;
+  size_t Bytes;
+  size_t Limit;
+  std::vector<sqlite3_stmt*> Prepared;
+  LogBuffer()
+  {
+    Bytes = 0;
+    Limit = DefaultLogBufferLimit;
+  }
+};
+
+static void FinalizeLogStatements(LogBuffer* logs)
+{
+  for (std::vector<sqlite3_stmt*>::const_iterator iter = logs->Prepared.begin(); iter != logs->Prepared.end(); ++iter)
+    sqlite3_finalize(*iter);
+  logs->Prepared.clear();
+}
+
+// Unlocks the bytevectors bound by osi::BindStatementAll. The caller
+// must first clear the statement bindings that refer to them.
+static void ReleaseScratch(StatementScratch* scratch)
+{
+  if (NULL == scratch)
+    return;
+  for (std::vector<ptr>::const_iterator iter = scratch->pinned.begin(); iter != scratch->pinned.end(); ++iter)
+    Sunlock_object(*iter);
+  scratch->pinned.clear();
+  scratch->bound = false;
+}
+
+static void FinalizeStatementEntry(const StatementEntry& ste)
+{
+  sqlite3_finalize(ste.stmt);
+  ReleaseScratch(ste.scratch);
+  delete ste.scratch;
+}
+
+// Each connection keeps up to limit statements prepared with
+// SQLITE_PREPARE_PERSISTENT, evicted in least-recently-used order. A
+// statement returned since the last osi::ReleaseCachedStatements may
+// still be held by Scheme, so it is not evicted until then, nor is one
+// in the middle of a step. The cache is only used from the Scheme
+// thread.
+static const size_t DefaultStatementCacheLimit = 256;
+
+static void RemoveCachedStatement(StatementCache* cache, iptr statement)
+{
+  for (CachedStatementList::iterator iter = cache->entries.begin(); iter != cache->entries.end(); ++iter)
+    if (statement == iter->second)
+    {
+      cache->index.erase(iter->first);
+      cache->entries.erase(iter);
+      cache->inUse.erase(statement);
+      return;
+    }
+}
+
+static void TrimStatementCache(StatementCache* cache)
+{
+  CachedStatementList::iterator iter = cache->entries.end();
+  while ((cache->entries.size() > cache->limit) && (cache->entries.begin() != iter))
+  {
+    --iter;
+    const StatementEntry& ste = LookupStatement(iter->second);
+    if ((cache->inUse.end() != cache->inUse.find(iter->second)) || sqlite3_stmt_busy(ste.stmt))
+      continue;
+    FinalizeStatementEntry(ste);
+    g_Statements.Deallocate(iter->second);
+    cache->index.erase(iter->first);
+    iter = cache->entries.erase(iter);
+    cache->evictions++;
+  }
+}
+
+// Slow-query tracing: the SQLITE_TRACE_PROFILE callback runs on worker
+// threads and claims a slot in a fixed ring without locking. Slots are
+// drained on the Scheme thread, and at most one notification is queued
+// on the completion port at a time. A query is dropped when its slot
+// has not been drained yet.
+enum { SlowQueryEmpty, SlowQueryWriting, SlowQueryFull };
+static const ULONG SlowQueryCapacity = 256;
+static const size_t SlowQueryMaxSQL = 4096;
+
+struct SlowQuery
+{
+  volatile LONG State;
+  ULONG Sequence;
+  sqlite3_int64 Nanoseconds;
+  std::string Database;
+  std::string SQL;
+};
+
+static SlowQuery g_SlowQueries[SlowQueryCapacity];
+static volatile LONG g_SlowQuerySequence = 0;
+static volatile LONG g_SlowQueryNotifyPending = 0;
+static volatile LONG g_SlowQueriesDropped = 0;
+static volatile LONG g_SlowQuerySampleCounter = 0;
+static volatile sqlite3_int64 g_SlowQueryThreshold = -1;
+static volatile LONG g_SlowQuerySampleEvery = 0;
+static ptr g_SlowQueryCallback = NULL;
+
+static ptr SlowQueriesReady(DWORD count, LPOVERLAPPED overlapped, DWORD error)
+{
+  InterlockedExchange(&g_SlowQueryNotifyPending, 0);
+  std::vector<std::pair<ULONG, ULONG> > full;
+  for (ULONG i = 0; i < SlowQueryCapacity; i++)
+    if (SlowQueryFull == g_SlowQueries[i].State)
+      full.push_back(std::make_pair(g_SlowQueries[i].Sequence, i));
+  std::sort(full.begin(), full.end());
+  ptr queries = Snil;
+  for (std::vector<std::pair<ULONG, ULONG> >::reverse_iterator iter = full.rbegin(); iter != full.rend(); ++iter)
+  {
+    SlowQuery& q = g_SlowQueries[iter->second];
+    if (NULL != g_SlowQueryCallback)
+    {
+      ptr sql = MakeSchemeString(q.SQL.data(), q.SQL.size());
+      ptr database = MakeSchemeString(q.Database.data(), q.Database.size());
+      ptr v = Smake_vector(3, Sfixnum(0));
+      Svector_set(v, 0, Spairp(database) ? Sfalse : database);
+      Svector_set(v, 1, Spairp(sql) ? Sfalse : sql);
+      Svector_set(v, 2, Sinteger64(q.Nanoseconds));
+      queries = Scons(v, queries);
+    }
+    InterlockedExchange(&q.State, SlowQueryEmpty);
+  }
+  LONG dropped = InterlockedExchange(&g_SlowQueriesDropped, 0);
+  if (NULL == g_SlowQueryCallback)
+    return Sfalse;
+  return MakeList(g_SlowQueryCallback, queries, Sinteger32(dropped));
+}
+
+static int TraceProfile(unsigned type, void* context, void* p, void* x)
+{
+  if (SQLITE_TRACE_PROFILE != type)
+    return 0;
+  sqlite3_int64 ns = *(sqlite3_int64*)x;
+  sqlite3_int64 threshold = g_SlowQueryThreshold;
+  LONG sampleEvery = g_SlowQuerySampleEvery;
+  bool slow = (threshold >= 0) && (ns >= threshold);
+  if (!slow && ((sampleEvery <= 0) ||
+      (0 != InterlockedIncrement(&g_SlowQuerySampleCounter) % sampleEvery)))
+    return 0;
+  ULONG sequence = (ULONG)InterlockedIncrement(&g_SlowQuerySequence);
+  SlowQuery& q = g_SlowQueries[sequence % SlowQueryCapacity];
+  if (SlowQueryEmpty != InterlockedCompareExchange(&q.State, SlowQueryWriting, SlowQueryEmpty))
+  {
+    InterlockedIncrement(&g_SlowQueriesDropped);
+    return 0;
+  }
+  sqlite3_stmt* stmt = (sqlite3_stmt*)p;
+  q.Sequence = sequence;
+  q.Nanoseconds = ns;
+  const char* filename = sqlite3_db_filename(sqlite3_db_handle(stmt), "main");
+  q.Database.assign(filename ? filename : "");
+  char* sql = sqlite3_expanded_sql(stmt);
+  const char* text = sql ? sql : sqlite3_sql(stmt);
+  size_t length = strlen(text);
+  if (length > SlowQueryMaxSQL)
+  {
+    // Don't split a UTF-8 sequence.
+    length = SlowQueryMaxSQL;
+    while ((length > 0) && (0x80 == (text[length] & 0xC0)))
+      length--;
+  }
+  q.SQL.assign(text, length);
+  sqlite3_free(sql);
+  InterlockedExchange(&q.State, SlowQueryFull);
+  if (0 == InterlockedExchange(&g_SlowQueryNotifyPending, 1))
+    PostIOComplete(0, SlowQueriesReady, NULL);
+  return 0;
+}
+
+ptr osi::SetSlowQueryTrace(UINT32 thresholdMilliseconds, UINT32 sampleEvery, ptr callback)
+{
+  if ((Sfalse != callback) && !Sprocedurep(callback))
+    return MakeErrorPair("osi::SetSlowQueryTrace", ERROR_BAD_ARGUMENTS);
+  if (NULL != g_SlowQueryCallback)
+  {
+    Sunlock_object(g_SlowQueryCallback);
+    g_SlowQueryCallback = NULL;
+  }
+  if (Sfalse == callback)
+  {
+    g_SlowQueryThreshold = -1;
+    g_SlowQuerySampleEvery = 0;
+    return Strue;
+  }
+  Slock_object(callback);
+  g_SlowQueryCallback = callback;
+  g_SlowQueryThreshold = (sqlite3_int64)thresholdMilliseconds * 1000000;
+  g_SlowQuerySampleEvery = (LONG)(sampleEvery > MAXLONG ? MAXLONG : sampleEvery);
+  return Strue;
+}
+
+ptr osi::SetDatabaseTrace(iptr database, bool enabled)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetDatabaseTrace", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::SetDatabaseTrace", ERROR_ACCESS_DENIED);
+  if (enabled)
+    sqlite3_trace_v2(dbe.db, SQLITE_TRACE_PROFILE, TraceProfile, NULL);
+  else
+    sqlite3_trace_v2(dbe.db, 0, NULL, NULL);
+  return Strue;
+}
+
 ptr osi::OpenDatabase(ptr filename, int flags)
 {
   if (!Sstringp(filename))
     return MakeErrorPair("osi::OpenDatabase", ERROR_BAD_ARGUMENTS);
   UTF8String u8filename(filename);
   DatabaseEntry dbe;
-  dbe.busy = false;
-  int rc = sqlite3_open_v2(u8filename.GetBuffer(), &(dbe.db), flags, NULL);
+  dbe.pending = 0;
+  dbe.shared = NULL;
+  dbe.thread = NULL;
+  dbe.cache = NULL;
+  dbe.logs = NULL;
+  int rc = sqlite3_open_v2(u8filename.GetBuffer(), &(dbe.db), flags | SQLITE_OPEN_NOMUTEX, NULL);
   if (SQLITE_OK != rc)
   {
     if (dbe.db)
@@ -81,32 +733,141 @@ ptr osi::OpenDatabase(ptr filename, int flags)
     return MakeSQLiteErrorPair("sqlite3_open_v2", rc);
   }
   sqlite3_extended_result_codes(dbe.db, 1);
+  sqlite3_trace_v2(dbe.db, SQLITE_TRACE_PROFILE, TraceProfile, NULL);
+  dbe.shared = new DatabaseShared;
+  dbe.shared->timeout = 0;
+  dbe.shared->deadline = 0;
+  dbe.shared->timedOut = 0;
+  dbe.shared->walFrames = 0;
+  dbe.shared->autoCheckpoint = DefaultAutoCheckpoint;
+  sqlite3_progress_handler(dbe.db, ProgressInterval, CheckDeadline, dbe.shared);
+  sqlite3_wal_hook(dbe.db, WalCommitted, dbe.shared);
+  dbe.thread = new DatabaseThread(dbe.shared);
+  dbe.cache = new StatementCache;
+  dbe.cache->limit = DefaultStatementCacheLimit;
+  dbe.cache->hits = 0;
+  dbe.cache->misses = 0;
+  dbe.cache->evictions = 0;
+  dbe.logs = new LogBuffer;
   return Sfixnum(g_Databases.Allocate(dbe));
 }
 
+static void CloseCursors(iptr database);
+
 ptr osi::CloseDatabase(iptr database)
 {
   DatabaseEntry dbe = LookupDatabase(database);
   if (NULL == dbe.db)
     return MakeErrorPair("osi::CloseDatabase", ERROR_INVALID_HANDLE);
-  if (dbe.busy)
+  if (dbe.pending)
     return MakeErrorPair("osi::CloseDatabase", ERROR_ACCESS_DENIED);
   std::list<iptr> toDeallocate;
   for (StatementMap::TMap::const_iterator iter = g_Statements.Map.begin(); iter != g_Statements.Map.end(); iter++)
     if (database == iter->second.db_handle)
     {
-      sqlite3_finalize(iter->second.stmt);
+      FinalizeStatementEntry(iter->second);
       toDeallocate.push_back(iter->first);
     }
   for (std::list<iptr>::const_iterator iter = toDeallocate.begin(); iter != toDeallocate.end(); iter++)
     g_Statements.Deallocate(*iter);
+  toDeallocate.clear();
+  for (BackupMap::TMap::const_iterator iter = g_Backups.Map.begin(); iter != g_Backups.Map.end(); iter++)
+    if (database == iter->second.db_handle)
+    {
+      FinishBackupEntry(iter->second);
+      toDeallocate.push_back(iter->first);
+    }
+  for (std::list<iptr>::const_iterator iter = toDeallocate.begin(); iter != toDeallocate.end(); iter++)
+    g_Backups.Deallocate(*iter);
+  CloseCursors(database);
+  CloseBlobPorts(database);
+  FinalizeLogStatements(dbe.logs);
   int rc = sqlite3_close(dbe.db);
   if (SQLITE_OK != rc)
     return MakeSQLiteErrorPair("sqlite3_close", rc);
+  delete dbe.thread;
+  delete dbe.shared;
+  delete dbe.cache;
+  delete dbe.logs;
   g_Databases.Deallocate(database);
   return Strue;
 }
 
+ptr osi::SetDatabaseTimeout(iptr database, UINT32 milliseconds)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetDatabaseTimeout", ERROR_INVALID_HANDLE);
+  // A running step keeps its deadline; the new timeout applies to the
+  // next one.
+  dbe.shared->timeout = milliseconds;
+  return Strue;
+}
+
+ptr osi::InterruptDatabase(iptr database)
+{
+  // sqlite3_interrupt is safe to call from another thread while the
+  // database is busy, and the database cannot be closed while busy.
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::InterruptDatabase", ERROR_INVALID_HANDLE);
+  sqlite3_interrupt(dbe.db);
+  return Strue;
+}
+
+ptr osi::SetDatabaseMemoryMap(iptr database, INT64 bytes)
+{
+  // PRAGMA mmap_size also tells the pager to fetch pages through the
+  // map, which SQLITE_FCNTL_MMAP_SIZE alone does not.
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetDatabaseMemoryMap", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::SetDatabaseMemoryMap", ERROR_ACCESS_DENIED);
+  if (bytes < 0)
+    return MakeErrorPair("osi::SetDatabaseMemoryMap", ERROR_BAD_ARGUMENTS);
+  char sql[64];
+  sprintf_s(sql, sizeof(sql), "PRAGMA mmap_size=%I64d", bytes);
+  int rc = sqlite3_exec(dbe.db, sql, NULL, NULL, NULL);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_exec", rc);
+  return Strue;
+}
+
+ptr osi::SetDatabaseCacheSize(iptr database, int size)
+{
+  // A negative size is in KiB rather than pages, as for PRAGMA
+  // cache_size.
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetDatabaseCacheSize", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::SetDatabaseCacheSize", ERROR_ACCESS_DENIED);
+  char sql[64];
+  sprintf_s(sql, sizeof(sql), "PRAGMA cache_size=%d", size);
+  int rc = sqlite3_exec(dbe.db, sql, NULL, NULL, NULL);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_exec", rc);
+  return Strue;
+}
+
+ptr osi::SetDatabaseLookaside(iptr database, UINT32 slotSize, UINT32 slotCount)
+{
+  // SQLite allocates the slots. It refuses with SQLITE_BUSY while any
+  // lookaside memory is in use.
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetDatabaseLookaside", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::SetDatabaseLookaside", ERROR_ACCESS_DENIED);
+  if ((slotSize > 65536) || (slotCount > 65536))
+    return MakeErrorPair("osi::SetDatabaseLookaside", ERROR_BAD_ARGUMENTS);
+  int rc = sqlite3_db_config(dbe.db, SQLITE_DBCONFIG_LOOKASIDE, NULL, (int)slotSize, (int)slotCount);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_db_config", rc);
+  return Strue;
+}
+
 ptr osi::PrepareStatement(iptr database, ptr sql)
 {
   if (!Sstringp(sql))
@@ -114,7 +875,7 @@ ptr osi::PrepareStatement(iptr database, ptr sql)
   DatabaseEntry dbe = LookupDatabase(database);
   if (NULL == dbe.db)
     return MakeErrorPair("osi::PrepareStatement", ERROR_INVALID_HANDLE);
-  if (dbe.busy)
+  if (dbe.pending)
     return MakeErrorPair("osi::PrepareStatement", ERROR_ACCESS_DENIED);
   UTF8String u8sql(sql);
   size_t len = u8sql.GetLength();
@@ -122,6 +883,8 @@ ptr osi::PrepareStatement(iptr database, ptr sql)
     return MakeSQLiteErrorPair("sqlite3_prepare_v2", SQLITE_TOOBIG);
   StatementEntry ste;
   ste.db_handle = database;
+  ste.scratch = NULL;
+  ste.cached = false;
   int rc = sqlite3_prepare_v2(dbe.db, u8sql.GetBuffer(), static_cast<long>(len), &(ste.stmt), NULL);
   if (SQLITE_OK != rc)
     return MakeSQLiteErrorPair("sqlite3_prepare_v2", rc);
@@ -133,9 +896,11 @@ ptr osi::FinalizeStatement(iptr statement)
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::FinalizeStatement", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::FinalizeStatement", ERROR_ACCESS_DENIED);
-  sqlite3_finalize(ste.stmt);
+  if (ste.cached)
+    RemoveCachedStatement(LookupDatabase(ste.db_handle).cache, statement);
+  FinalizeStatementEntry(ste);
   g_Statements.Deallocate(statement);
   return Strue;
 }
@@ -145,7 +910,7 @@ ptr osi::BindStatement(iptr statement, UINT index, ptr datum)
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::BindStatement", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::BindStatement", ERROR_ACCESS_DENIED);
   int rc;
   const char* who;
@@ -190,14 +955,106 @@ ptr osi::BindStatement(iptr statement, UINT index, ptr datum)
   return Strue;
 }
 
+ptr osi::BindStatementAll(iptr statement, ptr values)
+{
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::BindStatementAll", ERROR_INVALID_HANDLE);
+  if (LookupDatabase(ste.db_handle).pending)
+    return MakeErrorPair("osi::BindStatementAll", ERROR_ACCESS_DENIED);
+  if (!Svectorp(values))
+    return MakeErrorPair("osi::BindStatementAll", ERROR_BAD_ARGUMENTS);
+  iptr n = Svector_length(values);
+  size_t textLength = 0;
+  for (iptr i = 0; i < n; i++)
+  {
+    ptr datum = Svector_ref(values, i);
+    if (!IsBindable(datum))
+      return MakeErrorPair("osi::BindStatementAll", ERROR_BAD_ARGUMENTS);
+    if (Sstringp(datum))
+      textLength += UTF8String::GetEncodedLength(datum);
+  }
+  StatementScratch* scratch = ste.scratch;
+  if (NULL == scratch)
+  {
+    scratch = new StatementScratch();
+    scratch->bound = false;
+    g_Statements.Map.find(statement)->second.scratch = scratch;
+  }
+  sqlite3_reset(ste.stmt);
+  sqlite3_clear_bindings(ste.stmt);
+  ReleaseScratch(scratch);
+  // Text is encoded once into the arena and bound with SQLITE_STATIC.
+  // The arena keeps its capacity so that later bindings reuse it.
+  if (textLength > scratch->text.size())
+    scratch->text.resize(textLength);
+  char* text = textLength ? &scratch->text[0] : NULL;
+  scratch->bound = true;
+  for (iptr i = 0; i < n; i++)
+  {
+    ptr datum = Svector_ref(values, i);
+    int index = (int)i + 1;
+    int rc;
+    const char* who;
+    if (Sfalse == datum)
+    {
+      who = "sqlite3_bind_null";
+      rc = sqlite3_bind_null(ste.stmt, index);
+    }
+    else if (Sfixnump(datum) || Sbignump(datum))
+    {
+      who = "sqlite3_bind_int64";
+      rc = sqlite3_bind_int64(ste.stmt, index, Sinteger64_value(datum));
+    }
+    else if (Sflonump(datum))
+    {
+      who = "sqlite3_bind_double";
+      rc = sqlite3_bind_double(ste.stmt, index, Sflonum_value(datum));
+    }
+    else if (Sstringp(datum))
+    {
+      who = "sqlite3_bind_text";
+      char* end = UTF8String::Encode(datum, text);
+      size_t len = end - text;
+      if (len > MAXLONG)
+        rc = SQLITE_TOOBIG;
+      else
+        rc = sqlite3_bind_text(ste.stmt, index, text ? text : "", static_cast<long>(len), SQLITE_STATIC);
+      text = end;
+    }
+    else // bytevector
+    {
+      // The bytevector stays locked while SQLite refers to it.
+      who = "sqlite3_bind_blob";
+      size_t len = Sbytevector_length(datum);
+      if (len > MAXLONG)
+        rc = SQLITE_TOOBIG;
+      else
+      {
+        Slock_object(datum);
+        scratch->pinned.push_back(datum);
+        rc = sqlite3_bind_blob(ste.stmt, index, (const void*)Sbytevector_data(datum), (long)len, SQLITE_STATIC);
+      }
+    }
+    if (SQLITE_OK != rc)
+    {
+      sqlite3_clear_bindings(ste.stmt);
+      ReleaseScratch(scratch);
+      return MakeSQLiteErrorPair(who, rc);
+    }
+  }
+  return Strue;
+}
+
 ptr osi::ClearStatementBindings(iptr statement)
 {
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::ClearStatementBindings", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::ClearStatementBindings", ERROR_ACCESS_DENIED);
   int rc = sqlite3_clear_bindings(ste.stmt);
+  ReleaseScratch(ste.scratch);
   if (SQLITE_OK != rc)
     return MakeSQLiteErrorPair("sqlite3_clear_bindings", rc);
   return Strue;
@@ -208,17 +1065,27 @@ ptr osi::GetLastInsertRowid(iptr database)
   DatabaseEntry dbe = LookupDatabase(database);
   if (NULL == dbe.db)
     return MakeErrorPair("osi::GetLastInsertRowid", ERROR_INVALID_HANDLE);
-  if (dbe.busy)
+  if (dbe.pending)
     return MakeErrorPair("osi::GetLastInsertRowid", ERROR_ACCESS_DENIED);
   return Sinteger64(sqlite3_last_insert_rowid(dbe.db));
 }
 
-ptr osi::GetStatementColumns(iptr statement)
+ptr osi::GetAutocommit(iptr database)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetAutocommit", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::GetAutocommit", ERROR_ACCESS_DENIED);
+  return Sboolean(0 != sqlite3_get_autocommit(dbe.db));
+}
+
+ptr osi::GetStatementColumns(iptr statement)
 {
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::GetStatementColumns", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::GetStatementColumns", ERROR_ACCESS_DENIED);
   int count = sqlite3_column_count(ste.stmt);
   ptr v = Smake_vector(count, Sfixnum(0));
@@ -237,7 +1104,7 @@ ptr osi::GetStatementSQL(iptr statement)
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::GetStatementSQL", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::GetStatementSQL", ERROR_ACCESS_DENIED);
   return MakeSchemeString(sqlite3_sql(ste.stmt));
 }
@@ -247,103 +1114,1275 @@ ptr osi::ResetStatement(iptr statement)
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
     return MakeErrorPair("osi::ResetStatement", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
+  if (LookupDatabase(ste.db_handle).pending)
     return MakeErrorPair("osi::ResetStatement", ERROR_ACCESS_DENIED);
   int rc = sqlite3_reset(ste.stmt);
+  if (ste.scratch && ste.scratch->bound)
+  {
+    // Drop the bindings from osi::BindStatementAll so that their
+    // bytevectors are not kept locked.
+    sqlite3_clear_bindings(ste.stmt);
+    ReleaseScratch(ste.scratch);
+  }
   if (SQLITE_OK != rc)
     return MakeSQLiteErrorPair("sqlite3_reset", rc);
   return Strue;
 }
 
+// Steps a statement on the worker thread, copying up to MaxRows rows or
+// about MaxBytes bytes into Values in row-major order.
+class BufferedStepper : public DatabaseWorkItem
+{
+public:
+  sqlite3_stmt* Stmt;
+  ptr Callback;
+  UINT32 MaxRows;
+  size_t MaxBytes;
+  int ColumnCount;
+  UINT32 RowCount;
+  std::vector<SQLiteValue> Values;
+  BufferedStepper(sqlite3_stmt* stmt, iptr database, UINT32 maxRows, size_t maxBytes, ptr callback) :
+    DatabaseWorkItem(database)
+  {
+    Stmt = stmt;
+    Callback = callback;
+    MaxRows = maxRows;
+    MaxBytes = maxBytes;
+    ColumnCount = 0;
+    RowCount = 0;
+    Slock_object(Callback);
+  }
+  virtual ~BufferedStepper()
+  {
+    Sunlock_object(Callback);
+  }
+  virtual DWORD Work()
+  {
+    // Copy each row out of SQLite before stepping again, because the
+    // next step invalidates the column text and blob pointers. At
+    // least one row is stepped even if it exceeds MaxBytes.
+    ColumnCount = sqlite3_column_count(Stmt);
+    size_t bytes = 0;
+    do
+    {
+      int rc = sqlite3_step(Stmt);
+      if (SQLITE_ROW != rc)
+        return rc;
+      for (int i = 0; i < ColumnCount; i++)
+      {
+        Values.push_back(SQLiteValue());
+        SQLiteValue& c = Values.back();
+        c.Type = sqlite3_column_type(Stmt, i);
+        switch (c.Type)
+        {
+        case SQLITE_NULL:
+          break;
+        case SQLITE_INTEGER:
+          c.Integer = sqlite3_column_int64(Stmt, i);
+          break;
+        case SQLITE_FLOAT:
+          c.Float = sqlite3_column_double(Stmt, i);
+          break;
+        case SQLITE_TEXT:
+          {
+            const char* text = (const char*)sqlite3_column_text(Stmt, i);
+            c.Bytes.assign(text, sqlite3_column_bytes(Stmt, i));
+            break;
+          }
+        default: // SQLITE_BLOB
+          {
+            const char* blob = (const char*)sqlite3_column_blob(Stmt, i);
+            c.Bytes.assign(blob, sqlite3_column_bytes(Stmt, i));
+          }
+        }
+        bytes += sizeof(sqlite3_int64) + c.Bytes.size();
+      }
+      RowCount++;
+    } while ((RowCount < MaxRows) && (bytes < MaxBytes));
+    return SQLITE_ROW;
+  }
+  inline const SQLiteValue& GetValue(UINT32 row, int column)
+  {
+    return Values[(size_t)row * ColumnCount + column];
+  }
+  // Returns the Scheme value or an error pair for invalid UTF-8.
+  static ptr ValueToScheme(const SQLiteValue& v)
+  {
+    switch (v.Type)
+    {
+    case SQLITE_NULL:
+      return Sfalse;
+    case SQLITE_INTEGER:
+      return Sinteger64(v.Integer);
+    case SQLITE_FLOAT:
+      return Sflonum(v.Float);
+    case SQLITE_TEXT:
+      return MakeSchemeString(v.Bytes.data(), v.Bytes.size());
+    default: // SQLITE_BLOB
+      {
+        ptr x = Smake_bytevector((iptr)v.Bytes.size(), 0);
+        memcpy(Sbytevector_data(x), v.Bytes.data(), v.Bytes.size());
+        return x;
+      }
+    }
+  }
+  // Returns a vector of row vectors or an error pair for invalid UTF-8.
+  static ptr MakeRows(const std::vector<SQLiteValue>& values, UINT32 rowCount, int columnCount)
+  {
+    ptr rows = Smake_vector(rowCount, Sfixnum(0));
+    for (UINT32 r = 0; r < rowCount; r++)
+    {
+      ptr row = Smake_vector(columnCount, Sfixnum(0));
+      for (int i = 0; i < columnCount; i++)
+      {
+        ptr x = ValueToScheme(values[(size_t)r * columnCount + i]);
+        if (Spairp(x))
+          return x;
+        Svector_set(row, i, x);
+      }
+      Svector_set(rows, r, row);
+    }
+    return rows;
+  }
+  // Returns (callback #(x done?)) and deletes this.
+  ptr MakeResultPacket(DWORD error, ptr x)
+  {
+    ptr callback = Callback;
+    delete this;
+    ptr v = Smake_vector(2, Sfixnum(0));
+    Svector_set(v, 0, x);
+    Svector_set(v, 1, Sboolean(SQLITE_DONE == error));
+    return MakeList(callback, v);
+  }
+  // Returns (callback x) and deletes this.
+  ptr MakePacket(ptr x)
+  {
+    ptr callback = Callback;
+    delete this;
+    return MakeList(callback, x);
+  }
+};
+
 ptr osi::StepStatement(iptr statement, ptr callback)
 {
-  class Stepper : public WorkItem
+  // Copies the row on the connection's thread, because the next queued
+  // item may step the connection before the completion is dequeued.
+  class Stepper : public BufferedStepper
   {
   public:
-    sqlite3_stmt* Stmt;
-    iptr Database;
-    ptr Callback;
-    Stepper(sqlite3_stmt* stmt, iptr database, ptr callback)
+    Stepper(sqlite3_stmt* stmt, iptr database, ptr callback) :
+      BufferedStepper(stmt, database, 1, 0, callback)
     {
-      Stmt = stmt;
-      Database = database;
-      Callback = callback;
-      SetDatabaseBusy(Database, true);
-      Slock_object(Callback);
     }
-    virtual ~Stepper()
+    virtual ptr GetCompletionPacket(DWORD error)
     {
-      SetDatabaseBusy(Database, false);
-      Sunlock_object(Callback);
+      if (SQLITE_DONE == error)
+        return MakePacket(Sfalse);
+      if (SQLITE_ROW != error)
+        return MakePacket(MakeStepErrorPair(TimedOut, "sqlite3_step", error));
+      ptr row = Smake_vector(ColumnCount, Sfixnum(0));
+      for (int i = 0; i < ColumnCount; i++)
+      {
+        ptr x = ValueToScheme(GetValue(0, i));
+        if (Spairp(x))
+          return MakePacket(x);
+        Svector_set(row, i, x);
+      }
+      return MakePacket(row);
     }
-    virtual DWORD Work()
+  };
+
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::StepStatement", ERROR_INVALID_HANDLE);
+  if (!Sprocedurep(callback))
+    return MakeErrorPair("osi::StepStatement", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new Stepper(ste.stmt, ste.db_handle, callback));
+}
+
+ptr osi::StepStatementN(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback)
+{
+  class MultiStepper : public BufferedStepper
+  {
+  public:
+    MultiStepper(sqlite3_stmt* stmt, iptr database, UINT32 maxRows, size_t maxBytes, ptr callback) :
+      BufferedStepper(stmt, database, maxRows, maxBytes, callback)
     {
-      return sqlite3_step(Stmt);
     }
     virtual ptr GetCompletionPacket(DWORD error)
     {
-      sqlite3_stmt* stmt = Stmt;
-      ptr callback = Callback;
-      delete this;
-      ptr arg;
-      if (SQLITE_DONE == error)
-        arg = Sfalse;
-      else if (SQLITE_ROW == error)
+      if ((SQLITE_ROW != error) && (SQLITE_DONE != error))
+        return MakePacket(MakeStepErrorPair(TimedOut, "sqlite3_step", error));
+      ptr rows = MakeRows(Values, RowCount, ColumnCount);
+      if (Spairp(rows))
+        return MakePacket(rows);
+      return MakeResultPacket(error, rows);
+    }
+  };
+
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::StepStatementN", ERROR_INVALID_HANDLE);
+  if ((0 == maxRows) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::StepStatementN", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new MultiStepper(ste.stmt, ste.db_handle, maxRows, maxBytes, callback));
+}
+
+ptr osi::StepStatementColumnar(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback)
+{
+  class ColumnarStepper : public BufferedStepper
+  {
+  public:
+    ColumnarStepper(sqlite3_stmt* stmt, iptr database, UINT32 maxRows, size_t maxBytes, ptr callback) :
+      BufferedStepper(stmt, database, maxRows, maxBytes, callback)
+    {
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      if ((SQLITE_ROW != error) && (SQLITE_DONE != error))
+        return MakePacket(MakeStepErrorPair(TimedOut, "sqlite3_step", error));
+      ptr columns = Smake_vector(ColumnCount, Sfixnum(0));
+      for (int i = 0; i < ColumnCount; i++)
+      {
+        ptr x = MakeColumn(i);
+        if (Spairp(x))
+          return MakePacket(x);
+        Svector_set(columns, i, x);
+      }
+      return MakeResultPacket(error, columns);
+    }
+    ptr MakeColumn(int column)
+    {
+      // A column is packed when its non-null values all have the same
+      // storage class, which is integer, real, or text.
+      int type = SQLITE_NULL;
+      size_t textBytes = 0;
+      for (UINT32 r = 0; r < RowCount; r++)
       {
-        int n = sqlite3_column_count(stmt);
-        arg = Smake_vector(n, Sfixnum(0));
-        for (int i = 0; i < n; i++)
+        const SQLiteValue& v = GetValue(r, column);
+        if (SQLITE_NULL == v.Type)
+          continue;
+        if (SQLITE_NULL == type)
+          type = v.Type;
+        else if (type != v.Type)
+          type = SQLITE_BLOB;
+        textBytes += v.Bytes.size();
+      }
+      if ((SQLITE_NULL == type) || (SQLITE_BLOB == type))
+      {
+        ptr values = Smake_vector(RowCount, Sfixnum(0));
+        for (UINT32 r = 0; r < RowCount; r++)
         {
-          ptr x;
-          switch (sqlite3_column_type(stmt, i))
-          {
-          case SQLITE_NULL:
-            x = Sfalse;
-            break;
-          case SQLITE_INTEGER:
-            x = Sinteger64(sqlite3_column_int64(stmt, i));
-            break;
-          case SQLITE_FLOAT:
-            x = Sflonum(sqlite3_column_double(stmt, i));
-            break;
-          case SQLITE_TEXT:
-            {
-              const char* text = (const char*)sqlite3_column_text(stmt, i);
-              x = MakeSchemeString(text, sqlite3_column_bytes(stmt, i));
-              if (Spairp(x))
-                return MakeList(callback, x);
-              break;
-            }
-          default: // SQLITE_BLOB
-            {
-              const void* blob = sqlite3_column_blob(stmt, i);
-              int n = sqlite3_column_bytes(stmt, i);
-              x = Smake_bytevector(n, 0);
-              memcpy(Sbytevector_data(x), blob, n);
-            }
-          }
-          Svector_set(arg, i, x);
+          ptr x = ValueToScheme(GetValue(r, column));
+          if (Spairp(x))
+            return x;
+          Svector_set(values, r, x);
         }
+        ptr v = Smake_vector(2, Sfixnum(0));
+        Svector_set(v, 0, Sstring_to_symbol("values"));
+        Svector_set(v, 1, values);
+        return v;
       }
-      else
-        arg = MakeSQLiteErrorPair("sqlite3_step", error);
-      return MakeList(callback, arg);
+      ptr nulls = Smake_bytevector((RowCount + 7) / 8, 0);
+      octet* nullBits = Sbytevector_data(nulls);
+      for (UINT32 r = 0; r < RowCount; r++)
+        if (SQLITE_NULL == GetValue(r, column).Type)
+          nullBits[r / 8] |= (octet)(1 << (r % 8));
+      if (SQLITE_TEXT == type)
+      {
+        ptr text = Smake_bytevector((iptr)textBytes, 0);
+        ptr offsets = Smake_vector(RowCount + 1, Sfixnum(0));
+        octet* data = Sbytevector_data(text);
+        size_t offset = 0;
+        for (UINT32 r = 0; r < RowCount; r++)
+        {
+          const std::string& bytes = GetValue(r, column).Bytes;
+          memcpy(data + offset, bytes.data(), bytes.size());
+          offset += bytes.size();
+          Svector_set(offsets, r + 1, Sfixnum(offset));
+        }
+        ptr v = Smake_vector(4, Sfixnum(0));
+        Svector_set(v, 0, Sstring_to_symbol("text"));
+        Svector_set(v, 1, text);
+        Svector_set(v, 2, offsets);
+        Svector_set(v, 3, nulls);
+        return v;
+      }
+      ptr packed = Smake_bytevector((iptr)RowCount * 8, 0);
+      octet* data = Sbytevector_data(packed);
+      for (UINT32 r = 0; r < RowCount; r++)
+      {
+        const SQLiteValue& v = GetValue(r, column);
+        if (SQLITE_INTEGER == v.Type)
+          memcpy(data + (size_t)r * 8, &v.Integer, 8);
+        else if (SQLITE_FLOAT == v.Type)
+          memcpy(data + (size_t)r * 8, &v.Float, 8);
+      }
+      ptr v = Smake_vector(3, Sfixnum(0));
+      Svector_set(v, 0, Sstring_to_symbol((SQLITE_INTEGER == type) ? "integer" : "real"));
+      Svector_set(v, 1, packed);
+      Svector_set(v, 2, nulls);
+      return v;
     }
   };
 
   StatementEntry ste = LookupStatement(statement);
   if (NULL == ste.stmt)
-    return MakeErrorPair("osi::StepStatement", ERROR_INVALID_HANDLE);
-  if (LookupDatabase(ste.db_handle).busy)
-    return MakeErrorPair("osi::StepStatement", ERROR_ACCESS_DENIED);
+    return MakeErrorPair("osi::StepStatementColumnar", ERROR_INVALID_HANDLE);
+  if ((0 == maxRows) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::StepStatementColumnar", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new ColumnarStepper(ste.stmt, ste.db_handle, maxRows, maxBytes, callback));
+}
+
+// Steps a statement on the worker thread and writes each row as UTF-8
+// JSON or CSV text, so that no row is materialized in Scheme. A chunk
+// ends after MaxRows rows, once the text reaches MaxBytes bytes, or when
+// the statement is done. The first chunk after a reset starts the JSON
+// array or writes the CSV header line, and the last one closes the array.
+class SerializingStepper : public DatabaseWorkItem
+{
+public:
+  enum Format { JSON, CSV };
+  sqlite3_stmt* Stmt;
+  Format Kind;
+  ptr Callback;
+  UINT32 MaxRows;
+  size_t MaxBytes;
+  std::string Output;
+  const char* Who;
+  SerializingStepper(sqlite3_stmt* stmt, iptr database, Format kind, UINT32 maxRows, size_t maxBytes, ptr callback) :
+    DatabaseWorkItem(database)
+  {
+    Stmt = stmt;
+    Kind = kind;
+    Callback = callback;
+    MaxRows = maxRows;
+    MaxBytes = maxBytes;
+    Who = "sqlite3_step";
+    Slock_object(Callback);
+  }
+  virtual ~SerializingStepper()
+  {
+    Sunlock_object(Callback);
+  }
+  virtual DWORD Work()
+  {
+    // A statement that is not busy has not been stepped since it was
+    // reset, so this chunk is the first.
+    bool first = !sqlite3_stmt_busy(Stmt);
+    int count = sqlite3_column_count(Stmt);
+    std::vector<std::string> names(count);
+    for (int i = 0; i < count; i++)
+    {
+      const char* name = sqlite3_column_name(Stmt, i);
+      if (NULL == name)
+      {
+        Who = "sqlite3_column_name";
+        return SQLITE_NOMEM;
+      }
+      if (JSON == Kind)
+      {
+        AppendJSONString(names[i], name, strlen(name));
+        names[i].push_back(':');
+      }
+      else
+        AppendCSVField(names[i], name, strlen(name));
+    }
+    if (first && (JSON == Kind))
+      Output.push_back('[');
+    else if (first)
+    {
+      for (int i = 0; i < count; i++)
+      {
+        if (i > 0)
+          Output.push_back(',');
+        Output.append(names[i]);
+      }
+      Output.append("\r\n");
+    }
+    UINT32 rows = 0;
+    do
+    {
+      int rc = sqlite3_step(Stmt);
+      if (SQLITE_DONE == rc)
+      {
+        if (JSON == Kind)
+          Output.push_back(']');
+        return rc;
+      }
+      if (SQLITE_ROW != rc)
+        return rc;
+      if (JSON == Kind)
+      {
+        if (!first || (rows > 0))
+          Output.push_back(',');
+        Output.push_back('{');
+      }
+      for (int i = 0; i < count; i++)
+      {
+        if (i > 0)
+          Output.push_back(',');
+        if (JSON == Kind)
+          Output.append(names[i]);
+        AppendValue(i);
+      }
+      Output.append((JSON == Kind) ? "}" : "\r\n");
+      rows++;
+    } while ((rows < MaxRows) && (Output.size() < MaxBytes));
+    return SQLITE_ROW;
+  }
+  virtual ptr GetCompletionPacket(DWORD error)
+  {
+    ptr callback = Callback;
+    ptr x;
+    if ((SQLITE_ROW != error) && (SQLITE_DONE != error))
+      x = MakeStepErrorPair(TimedOut, Who, error);
+    else
+    {
+      ptr bv = Smake_bytevector((iptr)Output.size(), 0);
+      memcpy(Sbytevector_data(bv), Output.data(), Output.size());
+      x = Smake_vector(2, Sfixnum(0));
+      Svector_set(x, 0, bv);
+      Svector_set(x, 1, Sboolean(SQLITE_DONE == error));
+    }
+    delete this;
+    return MakeList(callback, x);
+  }
+private:
+  // Escapes as json:write does. Text is copied as stored.
+  static void AppendJSONString(std::string& out, const char* s, size_t n)
+  {
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (size_t i = 0; i < n; i++)
+    {
+      unsigned char c = s[i];
+      if (('"' == c) || ('\\' == c))
+      {
+        out.push_back('\\');
+        out.push_back(c);
+      }
+      else if (c <= 0x1F)
+      {
+        out.append("\\u00");
+        out.push_back(hex[c >> 4]);
+        out.push_back(hex[c & 15]);
+      }
+      else
+        out.push_back(c);
+    }
+    out.push_back('"');
+  }
+  // Quotes a field that contains a comma, quote, or line break, as in
+  // RFC 4180.
+  static void AppendCSVField(std::string& out, const char* s, size_t n)
+  {
+    size_t special = 0;
+    while ((special < n) && (NULL == strchr(",\"\r\n", s[special])))
+      special++;
+    if (special == n)
+    {
+      out.append(s, n);
+      return;
+    }
+    out.push_back('"');
+    for (size_t i = 0; i < n; i++)
+    {
+      if ('"' == s[i])
+        out.push_back('"');
+      out.push_back(s[i]);
+    }
+    out.push_back('"');
+  }
+  static void AppendHex(std::string& out, const unsigned char* p, size_t n)
+  {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++)
+    {
+      out.push_back(hex[p[i] >> 4]);
+      out.push_back(hex[p[i] & 15]);
+    }
+  }
+  // Uses the fewest digits that read back as the same double, with a
+  // decimal point so that it reads back as a flonum.
+  static void AppendDouble(std::string& out, double d)
+  {
+    char buf[32];
+    for (int precision = 15; precision <= 17; precision++)
+    {
+      sprintf_s(buf, sizeof(buf), "%.*g", precision, d);
+      if (strtod(buf, NULL) == d)
+        break;
+    }
+    out.append(buf);
+    if (strcspn(buf, ".e") == strlen(buf))
+      out.append(".0");
+  }
+  void AppendValue(int i)
+  {
+    switch (sqlite3_column_type(Stmt, i))
+    {
+    case SQLITE_NULL:
+      if (JSON == Kind)
+        Output.append("null");
+      break;
+    case SQLITE_INTEGER:
+      {
+        char buf[32];
+        sprintf_s(buf, sizeof(buf), "%I64d", (INT64)sqlite3_column_int64(Stmt, i));
+        Output.append(buf);
+        break;
+      }
+    case SQLITE_FLOAT:
+      {
+        double d = sqlite3_column_double(Stmt, i);
+        if (d - d == 0) // finite
+          AppendDouble(Output, d);
+        else if (JSON == Kind)
+          Output.append("null");
+        break;
+      }
+    case SQLITE_TEXT:
+      {
+        const char* text = (const char*)sqlite3_column_text(Stmt, i);
+        size_t n = sqlite3_column_bytes(Stmt, i);
+        if (JSON == Kind)
+          AppendJSONString(Output, text, n);
+        else
+          AppendCSVField(Output, text, n);
+        break;
+      }
+    default: // SQLITE_BLOB, as a hex string
+      {
+        const unsigned char* blob = (const unsigned char*)sqlite3_column_blob(Stmt, i);
+        size_t n = sqlite3_column_bytes(Stmt, i);
+        if (JSON == Kind)
+          Output.push_back('"');
+        AppendHex(Output, blob, n);
+        if (JSON == Kind)
+          Output.push_back('"');
+      }
+    }
+  }
+};
+
+ptr osi::StepStatementAsJSON(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback)
+{
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::StepStatementAsJSON", ERROR_INVALID_HANDLE);
+  if ((0 == maxRows) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::StepStatementAsJSON", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new SerializingStepper(ste.stmt, ste.db_handle, SerializingStepper::JSON, maxRows, maxBytes, callback));
+}
+
+ptr osi::StepStatementAsCSV(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback)
+{
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::StepStatementAsCSV", ERROR_INVALID_HANDLE);
+  if ((0 == maxRows) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::StepStatementAsCSV", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new SerializingStepper(ste.stmt, ste.db_handle, SerializingStepper::CSV, maxRows, maxBytes, callback));
+}
+
+// A cursor steps its statement ahead of the reader in batches of up to
+// BatchRows rows on the thread of its database and keeps at most
+// MaxBatches of them in native memory. Stepping pauses while the queue
+// is full and resumes when osi::ReadCursor takes a batch. The queue and
+// flags are only used on the Scheme thread.
+struct CursorBatch
+{
+  DWORD Error; // a Windows error code, or 0 for a stepped batch
+  DWORD Status; // SQLITE_ROW, SQLITE_DONE, or a SQLite error code
+  bool TimedOut;
+  int ColumnCount;
+  UINT32 RowCount;
+  std::vector<SQLiteValue> Values;
+};
+
+class Cursor
+{
+public:
+  iptr Statement;
+  iptr Database;
+  UINT32 BatchRows;
+  UINT32 MaxBatches;
+  std::deque<CursorBatch*> Ready;
+  ptr Reader; // the callback of the pending read, or NULL
+  ptr Closer; // the callback of osi::CloseCursor, or NULL
+  bool Filling; // a batch is being stepped
+  bool Posted; // a Notify packet has been posted
+  bool Finished; // the last batch is in Ready or has been read
+  bool Closed;
+  Cursor(iptr statement, iptr database, UINT32 batchRows, UINT32 maxBatches)
+  {
+    Statement = statement;
+    Database = database;
+    BatchRows = batchRows;
+    MaxBatches = maxBatches;
+    Reader = NULL;
+    Closer = NULL;
+    Filling = false;
+    Posted = false;
+    Finished = false;
+    Closed = false;
+  }
+  ~Cursor()
+  {
+    DeleteBatches();
+    if (NULL != Reader)
+      Sunlock_object(Reader);
+    if (NULL != Closer)
+      Sunlock_object(Closer);
+  }
+  ptr Fill();
+  ptr Deliver();
+  void Post()
+  {
+    if (!Posted)
+    {
+      Posted = true;
+      PostIOComplete(0, Notify, (LPOVERLAPPED)this);
+    }
+  }
+  // The cursor is deleted once no packet refers to it.
+  void Close()
+  {
+    Closed = true;
+    DeleteBatches();
+    if (!Filling && !Posted)
+      delete this;
+  }
+  // Closes the cursor and posts (callback #t) once no batch is being
+  // stepped, so that the statement and database can be used again.
+  void Close(ptr callback)
+  {
+    Closed = true;
+    DeleteBatches();
+    Closer = callback;
+    Slock_object(Closer);
+    if (!Filling)
+      Post();
+  }
+  // Called for each packet of a closed cursor.
+  ptr Release()
+  {
+    ptr packet = Sfalse;
+    if (!Filling && (NULL != Closer))
+    {
+      packet = MakeList(Closer, Strue);
+      Sunlock_object(Closer);
+      Closer = NULL;
+    }
+    if (!Filling && !Posted)
+      delete this;
+    return packet;
+  }
+private:
+  void DeleteBatches()
+  {
+    for (std::deque<CursorBatch*>::const_iterator iter = Ready.begin(); iter != Ready.end(); ++iter)
+      delete *iter;
+    Ready.clear();
+  }
+  // Returns (reader x) for the batch.
+  ptr MakeReadPacket(CursorBatch* batch)
+  {
+    ptr x;
+    if (0 != batch->Error)
+      x = MakeErrorPair("osi::ReadCursor", batch->Error);
+    else if ((SQLITE_ROW != batch->Status) && (SQLITE_DONE != batch->Status))
+      x = MakeStepErrorPair(batch->TimedOut, "sqlite3_step", batch->Status);
+    else
+    {
+      x = BufferedStepper::MakeRows(batch->Values, batch->RowCount, batch->ColumnCount);
+      if (!Spairp(x))
+      {
+        ptr v = Smake_vector(2, Sfixnum(0));
+        Svector_set(v, 0, x);
+        Svector_set(v, 1, Sboolean(SQLITE_DONE == batch->Status));
+        x = v;
+      }
+    }
+    ptr callback = Reader;
+    Reader = NULL;
+    Sunlock_object(callback);
+    return MakeList(callback, x);
+  }
+  static ptr Notify(DWORD count, LPOVERLAPPED overlapped, DWORD error)
+  {
+    Cursor* cursor = (Cursor*)overlapped;
+    cursor->Posted = false;
+    if (cursor->Closed)
+      return cursor->Release();
+    return cursor->Deliver();
+  }
+};
+
+class CursorFill : public BufferedStepper
+{
+public:
+  Cursor* Owner;
+  CursorFill(Cursor* owner, sqlite3_stmt* stmt) :
+    BufferedStepper(stmt, owner->Database, owner->BatchRows, (size_t)-1, Sfalse)
+  {
+    Owner = owner;
+  }
+  virtual ptr GetCompletionPacket(DWORD error)
+  {
+    Cursor* cursor = Owner;
+    CursorBatch* batch = new CursorBatch;
+    batch->Error = 0;
+    batch->Status = error;
+    batch->TimedOut = TimedOut;
+    batch->ColumnCount = ColumnCount;
+    batch->RowCount = RowCount;
+    batch->Values.swap(Values);
+    delete this;
+    cursor->Filling = false;
+    if (cursor->Closed)
+    {
+      delete batch;
+      return cursor->Release();
+    }
+    if (SQLITE_ROW != batch->Status)
+      cursor->Finished = true;
+    cursor->Ready.push_back(batch);
+    return cursor->Deliver();
+  }
+};
+
+// Steps the next batch unless one is being stepped, the statement is
+// done, or the queue is full.
+ptr Cursor::Fill()
+{
+  if (Filling || Finished || (Ready.size() >= MaxBatches))
+    return Strue;
+  sqlite3_stmt* stmt = LookupStatement(Statement).stmt;
+  if (NULL == stmt)
+  {
+    CursorBatch* batch = new CursorBatch;
+    batch->Error = ERROR_INVALID_HANDLE;
+    batch->Status = SQLITE_DONE;
+    batch->TimedOut = false;
+    batch->ColumnCount = 0;
+    batch->RowCount = 0;
+    Finished = true;
+    Ready.push_back(batch);
+    return Strue;
+  }
+  ptr rc = StartDatabaseWorker(new CursorFill(this, stmt));
+  if (Strue == rc)
+    Filling = true;
+  return rc;
+}
+
+// Returns the packet for the pending read when a batch is ready, and
+// keeps stepping ahead. Once the database thread exists, Fill cannot
+// fail.
+ptr Cursor::Deliver()
+{
+  ptr packet = Sfalse;
+  if ((NULL != Reader) && !Ready.empty())
+  {
+    CursorBatch* batch = Ready.front();
+    Ready.pop_front();
+    packet = MakeReadPacket(batch);
+    delete batch;
+  }
+  else if ((NULL != Reader) && Finished)
+  {
+    CursorBatch batch;
+    batch.Error = 0;
+    batch.Status = SQLITE_DONE;
+    batch.TimedOut = false;
+    batch.ColumnCount = 0;
+    batch.RowCount = 0;
+    packet = MakeReadPacket(&batch);
+  }
+  Fill();
+  return packet;
+}
+
+typedef HandleMap<Cursor*, 32693> CursorMap;
+static CursorMap g_Cursors;
+
+static void CloseCursors(iptr database)
+{
+  std::list<iptr> toDeallocate;
+  for (CursorMap::TMap::const_iterator iter = g_Cursors.Map.begin(); iter != g_Cursors.Map.end(); iter++)
+    if (database == iter->second->Database)
+      toDeallocate.push_back(iter->first);
+  for (std::list<iptr>::const_iterator iter = toDeallocate.begin(); iter != toDeallocate.end(); iter++)
+  {
+    Cursor* cursor = g_Cursors.Map.find(*iter)->second;
+    g_Cursors.Deallocate(*iter);
+    cursor->Close();
+  }
+}
+
+ptr osi::OpenCursor(iptr statement, UINT32 batchRows, UINT32 maxBatches)
+{
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::OpenCursor", ERROR_INVALID_HANDLE);
+  if ((0 == batchRows) || (0 == maxBatches))
+    return MakeErrorPair("osi::OpenCursor", ERROR_BAD_ARGUMENTS);
+  Cursor* cursor = new Cursor(statement, ste.db_handle, batchRows, maxBatches);
+  ptr rc = cursor->Fill();
+  if (Spairp(rc))
+  {
+    delete cursor;
+    return rc;
+  }
+  return Sfixnum(g_Cursors.Allocate(cursor));
+}
+
+ptr osi::ReadCursor(iptr cursor, ptr callback)
+{
+  Cursor* c = g_Cursors.Lookup(cursor, NULL);
+  if (NULL == c)
+    return MakeErrorPair("osi::ReadCursor", ERROR_INVALID_HANDLE);
   if (!Sprocedurep(callback))
-    return MakeErrorPair("osi::StepStatement", ERROR_BAD_ARGUMENTS);
-  return StartWorker(new Stepper(ste.stmt, ste.db_handle, callback));
+    return MakeErrorPair("osi::ReadCursor", ERROR_BAD_ARGUMENTS);
+  if (NULL != c->Reader)
+    return MakeErrorPair("osi::ReadCursor", ERROR_ACCESS_DENIED);
+  ptr rc = c->Fill();
+  if (Spairp(rc))
+    return rc;
+  c->Reader = callback;
+  Slock_object(callback);
+  if (!c->Ready.empty() || c->Finished)
+    c->Post();
+  return Strue;
 }
 
-ptr osi::GetSQLiteStatus(int operation, bool reset)
+ptr osi::CloseCursor(iptr cursor, ptr callback)
 {
-  int current;
+  Cursor* c = g_Cursors.Lookup(cursor, NULL);
+  if (NULL == c)
+    return MakeErrorPair("osi::CloseCursor", ERROR_INVALID_HANDLE);
+  if (!Sprocedurep(callback))
+    return MakeErrorPair("osi::CloseCursor", ERROR_BAD_ARGUMENTS);
+  if (NULL != c->Reader)
+    return MakeErrorPair("osi::CloseCursor", ERROR_ACCESS_DENIED);
+  g_Cursors.Deallocate(cursor);
+  c->Close(callback);
+  return Strue;
+}
+
+ptr osi::ExecuteBatch(iptr statement, ptr bindings, ptr callback)
+{
+  class BatchExecutor : public DatabaseWorkItem
+  {
+  public:
+    struct RowError
+    {
+      UINT32 Row;
+      const char* Who;
+      int Code;
+    };
+    sqlite3_stmt* Stmt;
+    StatementScratch* Scratch;
+    ptr Callback;
+    std::vector<UINT32> Counts;
+    std::vector<SQLiteValue> Values;
+    std::vector<RowError> Errors;
+    BatchExecutor(const StatementEntry& ste, ptr bindings, ptr callback) :
+      DatabaseWorkItem(ste.db_handle)
+    {
+      Stmt = ste.stmt;
+      // Bindings from osi::BindStatementAll are cleared by Work, after
+      // which the scratch can be released.
+      Scratch = (ste.scratch && ste.scratch->bound) ? ste.scratch : NULL;
+      Callback = callback;
+      iptr rows = Svector_length(bindings);
+      Counts.reserve(rows);
+      for (iptr r = 0; r < rows; r++)
+      {
+        ptr row = Svector_ref(bindings, r);
+        iptr n = Svector_length(row);
+        Counts.push_back((UINT32)n);
+        for (iptr i = 0; i < n; i++)
+        {
+          Values.push_back(SQLiteValue());
+          CopyValue(Svector_ref(row, i), Values.back());
+        }
+      }
+      Slock_object(Callback);
+    }
+    virtual ~BatchExecutor()
+    {
+      Sunlock_object(Callback);
+    }
+    virtual DWORD Work()
+    {
+      std::vector<SQLiteValue>::const_iterator v = Values.begin();
+      bool interrupted = false;
+      for (UINT32 r = 0; r < Counts.size(); r++)
+      {
+        if (interrupted)
+        {
+          // Rows after an interrupt or timeout are not executed.
+          v += Counts[r];
+          RowError e = {r, "sqlite3_step", SQLITE_INTERRUPT};
+          Errors.push_back(e);
+          continue;
+        }
+        const char* who = NULL;
+        int rc = SQLITE_OK;
+        sqlite3_reset(Stmt);
+        sqlite3_clear_bindings(Stmt);
+        for (UINT32 i = 0; i < Counts[r]; i++, ++v)
+        {
+          if (NULL != who)
+            continue;
+          rc = BindValue(Stmt, (int)i + 1, *v, who);
+        }
+        if (NULL == who)
+        {
+          do
+            rc = sqlite3_step(Stmt);
+          while (SQLITE_ROW == rc);
+          if (SQLITE_DONE != rc)
+            who = "sqlite3_step";
+        }
+        if (NULL != who)
+        {
+          RowError e = {r, who, rc};
+          Errors.push_back(e);
+          interrupted = (SQLITE_INTERRUPT == rc);
+        }
+      }
+      // Values are bound with SQLITE_STATIC, so they must not outlive
+      // this work item.
+      sqlite3_reset(Stmt);
+      sqlite3_clear_bindings(Stmt);
+      return 0;
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      ptr callback = Callback;
+      ReleaseScratch(Scratch);
+      ptr errors = Snil;
+      for (std::vector<RowError>::reverse_iterator iter = Errors.rbegin(); iter != Errors.rend(); ++iter)
+        errors = Scons(Scons(Sunsigned32(iter->Row), MakeStepErrorPair(TimedOut, iter->Who, iter->Code)), errors);
+      delete this;
+      return MakeList(callback, errors);
+    }
+  };
+
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::ExecuteBatch", ERROR_INVALID_HANDLE);
+  if (!Svectorp(bindings) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::ExecuteBatch", ERROR_BAD_ARGUMENTS);
+  iptr rows = Svector_length(bindings);
+  for (iptr r = 0; r < rows; r++)
+  {
+    ptr row = Svector_ref(bindings, r);
+    if (!Svectorp(row))
+      return MakeErrorPair("osi::ExecuteBatch", ERROR_BAD_ARGUMENTS);
+    iptr n = Svector_length(row);
+    for (iptr i = 0; i < n; i++)
+      if (!IsBindable(Svector_ref(row, i)))
+        return MakeErrorPair("osi::ExecuteBatch", ERROR_BAD_ARGUMENTS);
+  }
+  return StartDatabaseWorker(new BatchExecutor(ste, bindings, callback));
+}
+
+static size_t LogValueBytes(const SQLiteValue& v)
+{
+  return sizeof(SQLiteValue) + v.Bytes.size();
+}
+
+static UINT32 InternLogSQL(LogBuffer* logs, const std::string& key)
+{
+  std::unordered_map<std::string, UINT32>::const_iterator found = logs->Index.find(key);
+  if (logs->Index.end() != found)
+    return found->second;
+  UINT32 statement = (UINT32)logs->SQL.size();
+  logs->SQL.push_back(key);
+  logs->Index[key] = statement;
+  return statement;
+}
+
+ptr osi::AppendLog(iptr database, ptr sql, ptr bindings)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::AppendLog", ERROR_INVALID_HANDLE);
+  if (!Sstringp(sql))
+    return MakeErrorPair("osi::AppendLog", ERROR_BAD_ARGUMENTS);
+  UINT32 count = 0;
+  ptr x = bindings;
+  for (; Spairp(x); x = Scdr(x), count++)
+    if (!IsBindable(Scar(x)))
+      return MakeErrorPair("osi::AppendLog", ERROR_BAD_ARGUMENTS);
+  if (Snil != x)
+    return MakeErrorPair("osi::AppendLog", ERROR_BAD_ARGUMENTS);
+  // Past the limit the row is refused, and the caller waits for a drain.
+  LogBuffer* logs = dbe.logs;
+  if (logs->Bytes >= logs->Limit)
+    return MakeErrorPair("osi::AppendLog", ERROR_NOT_ENOUGH_QUOTA);
+  UTF8String u8sql(sql);
+  std::string key(u8sql.GetBuffer(), u8sql.GetLength() - 1);
+  LogRecord record = {InternLogSQL(logs, key), count};
+  logs->Records.push_back(record);
+  logs->Bytes += sizeof(LogRecord);
+  for (x = bindings; Spairp(x); x = Scdr(x))
+  {
+    logs->Values.push_back(SQLiteValue());
+    CopyValue(Scar(x), logs->Values.back());
+    logs->Bytes += LogValueBytes(logs->Values.back());
+  }
+  return Sfixnum(logs->Records.size());
+}
+
+ptr osi::GetLogCount(iptr database)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetLogCount", ERROR_INVALID_HANDLE);
+  return Sfixnum(dbe.logs->Records.size());
+}
+
+ptr osi::SetLogBufferLimit(iptr database, size_t bytes)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetLogBufferLimit", ERROR_INVALID_HANDLE);
+  if (0 == bytes)
+    return MakeErrorPair("osi::SetLogBufferLimit", ERROR_BAD_ARGUMENTS);
+  dbe.logs->Limit = bytes;
+  return Strue;
+}
+
+ptr osi::DrainLogs(iptr database, UINT32 maxRecords, ptr callback)
+{
+  class LogDrainer : public DatabaseWorkItem
+  {
+  public:
+    sqlite3* DB;
+    LogBuffer* Logs;
+    std::vector<std::string> SQL;
+    std::deque<LogRecord> Records;
+    std::deque<SQLiteValue> Values;
+    bool Reset;
+    ptr Callback;
+    UINT32 Done;
+    const char* Who;
+    int Code;
+    std::string FailedSQL;
+    LogDrainer(iptr database, const DatabaseEntry& dbe, UINT32 maxRecords, ptr callback) :
+      DatabaseWorkItem(database)
+    {
+      DB = dbe.db;
+      Logs = dbe.logs;
+      SQL = Logs->SQL;
+      if (Logs->Records.size() <= maxRecords)
+      {
+        Records.swap(Logs->Records);
+        Values.swap(Logs->Values);
+        Logs->Bytes = 0;
+      }
+      else
+      {
+        // Taking from the front of the deques costs only the records
+        // taken, however large the backlog.
+        for (UINT32 i = 0; i < maxRecords; i++)
+        {
+          LogRecord r = Logs->Records.front();
+          Logs->Records.pop_front();
+          Records.push_back(r);
+          for (UINT32 j = 0; j < r.Count; j++)
+          {
+            Values.push_back(SQLiteValue());
+            std::swap(Values.back(), Logs->Values.front());
+            Logs->Values.pop_front();
+            Logs->Bytes -= LogValueBytes(Values.back());
+          }
+        }
+        Logs->Bytes -= maxRecords * sizeof(LogRecord);
+      }
+      // The statements are forgotten together once there are too many
+      // and no buffered row refers to them. New rows get new
+      // identifiers, and the prepared statements are finalized after
+      // this batch.
+      Reset = Logs->Records.empty() && (Logs->SQL.size() > LogStatementLimit);
+      if (Reset)
+      {
+        Logs->SQL.clear();
+        Logs->Index.clear();
+      }
+      Callback = callback;
+      Done = 0;
+      Who = NULL;
+      Code = SQLITE_OK;
+      Slock_object(Callback);
+    }
+    virtual ~LogDrainer()
+    {
+      Sunlock_object(Callback);
+    }
+    virtual DWORD Work()
+    {
+      std::vector<sqlite3_stmt*>& prepared = Logs->Prepared;
+      std::deque<SQLiteValue>::const_iterator v = Values.begin();
+      for (std::deque<LogRecord>::const_iterator r = Records.begin(); r != Records.end(); ++r)
+      {
+        if (prepared.size() <= r->Statement)
+          prepared.resize(SQL.size(), NULL);
+        sqlite3_stmt*& stmt = prepared[r->Statement];
+        int rc = SQLITE_OK;
+        if (NULL == stmt)
+        {
+          rc = sqlite3_prepare_v3(DB, SQL[r->Statement].c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+          if (SQLITE_OK != rc)
+            Who = "sqlite3_prepare_v3";
+        }
+        for (UINT32 i = 0; (NULL == Who) && (i < r->Count); i++)
+          rc = BindValue(stmt, (int)i + 1, v[i], Who);
+        if (NULL == Who)
+        {
+          do
+            rc = sqlite3_step(stmt);
+          while (SQLITE_ROW == rc);
+          if (SQLITE_DONE != rc)
+            Who = "sqlite3_step";
+        }
+        // Values are bound with SQLITE_STATIC, so they must not
+        // outlive this work item.
+        if (NULL != stmt)
+        {
+          sqlite3_reset(stmt);
+          sqlite3_clear_bindings(stmt);
+        }
+        v += r->Count;
+        if (NULL != Who)
+        {
+          // The rows after a failure are not executed.
+          Code = rc;
+          FailedSQL = SQL[r->Statement];
+          break;
+        }
+        Done++;
+      }
+      if (Reset)
+        FinalizeLogStatements(Logs);
+      return 0;
+    }
+    // After a failure the caller rolls back, so every record of the
+    // batch except the failed one goes back to the front of the
+    // buffer. An interrupted record is kept, too.
+    void Requeue()
+    {
+      bool keepFailed = (SQLITE_INTERRUPT == Code) || TimedOut;
+      std::deque<LogRecord> records;
+      std::deque<SQLiteValue> values;
+      std::deque<SQLiteValue>::iterator v = Values.begin();
+      for (UINT32 i = 0; i < Records.size(); i++)
+      {
+        LogRecord r = Records[i];
+        bool keep = (i != Done) || keepFailed;
+        if (keep)
+        {
+          r.Statement = InternLogSQL(Logs, SQL[r.Statement]);
+          records.push_back(r);
+          Logs->Bytes += sizeof(LogRecord);
+        }
+        for (UINT32 j = 0; j < r.Count; j++, ++v)
+          if (keep)
+          {
+            values.push_back(SQLiteValue());
+            std::swap(values.back(), *v);
+            Logs->Bytes += LogValueBytes(values.back());
+          }
+      }
+      records.insert(records.end(), Logs->Records.begin(), Logs->Records.end());
+      Logs->Records.swap(records);
+      for (std::deque<SQLiteValue>::iterator iter = Logs->Values.begin(); iter != Logs->Values.end(); ++iter)
+      {
+        values.push_back(SQLiteValue());
+        std::swap(values.back(), *iter);
+      }
+      Logs->Values.swap(values);
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      ptr callback = Callback;
+      ptr result;
+      if (NULL == Who)
+        result = Sunsigned32(Done);
+      else
+      {
+        Requeue();
+        result = Scons(MakeSchemeString(FailedSQL.data(), FailedSQL.size()),
+          MakeStepErrorPair(TimedOut, Who, Code));
+      }
+      delete this;
+      return MakeList(callback, result);
+    }
+  };
+
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::DrainLogs", ERROR_INVALID_HANDLE);
+  if ((0 == maxRecords) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::DrainLogs", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new LogDrainer(database, dbe, maxRecords, callback));
+}
+
+static void* g_PageCache = NULL;
+
+ptr osi::ConfigureSQLite(UINT32 pageSize, UINT32 pageCount, UINT32 lookasideSize, UINT32 lookasideCount, bool memoryStatus)
+{
+  // sqlite3_config fails with SQLITE_MISUSE once SQLite is initialized,
+  // which happens when the first database is opened. The page cache
+  // buffer is kept for the life of the process.
+  if ((0 != pageCount) && ((pageSize < 512) || (pageSize > 65536) || (0 != (pageSize & (pageSize - 1)))))
+    return MakeErrorPair("osi::ConfigureSQLite", ERROR_BAD_ARGUMENTS);
+  if ((lookasideSize > 65536) || (lookasideCount > 65536))
+    return MakeErrorPair("osi::ConfigureSQLite", ERROR_BAD_ARGUMENTS);
+  int header = 0;
+  int rc = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_config", rc);
+  size_t lineSize = (0 == pageCount) ? 0 : pageSize + header;
+  void* pageCache = NULL;
+  if (0 != pageCount)
+  {
+    pageCache = malloc(lineSize * pageCount);
+    if (NULL == pageCache)
+      return MakeErrorPair("osi::ConfigureSQLite", ERROR_NOT_ENOUGH_MEMORY);
+  }
+  rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pageCache, (int)lineSize, (int)pageCount);
+  if (SQLITE_OK != rc)
+  {
+    free(pageCache);
+    return MakeSQLiteErrorPair("sqlite3_config", rc);
+  }
+  free(g_PageCache);
+  g_PageCache = pageCache;
+  rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, (int)lookasideSize, (int)lookasideCount);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_config", rc);
+  rc = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, memoryStatus ? 1 : 0);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_config", rc);
+  return Strue;
+}
+
+ptr osi::SetSoftHeapLimit(INT64 limit)
+{
+  // A negative limit only returns the current one.
+  return Sinteger64(sqlite3_soft_heap_limit64(limit));
+}
+
+ptr osi::GetSQLiteStatus(int operation, bool reset)
+{
+  int current;
   int highwater;
   int rc = sqlite3_status(operation, &current, &highwater, reset);
   if (SQLITE_OK != rc)
@@ -353,3 +2392,346 @@ ptr osi::GetSQLiteStatus(int operation, bool reset)
   Svector_set(v, 1, Sinteger(highwater));
   return v;
 }
+
+ptr osi::GetStatementStatus(iptr statement, bool reset)
+{
+  static const int operations[] = {
+    SQLITE_STMTSTATUS_FULLSCAN_STEP,
+    SQLITE_STMTSTATUS_SORT,
+    SQLITE_STMTSTATUS_AUTOINDEX,
+    SQLITE_STMTSTATUS_VM_STEP,
+    SQLITE_STMTSTATUS_REPREPARE,
+    SQLITE_STMTSTATUS_RUN,
+    SQLITE_STMTSTATUS_MEMUSED
+  };
+  const int count = sizeof(operations) / sizeof(operations[0]);
+  StatementEntry ste = LookupStatement(statement);
+  if (NULL == ste.stmt)
+    return MakeErrorPair("osi::GetStatementStatus", ERROR_INVALID_HANDLE);
+  if (LookupDatabase(ste.db_handle).pending)
+    return MakeErrorPair("osi::GetStatementStatus", ERROR_ACCESS_DENIED);
+  ptr v = Smake_vector(count, Sfixnum(0));
+  for (int i = 0; i < count; i++)
+    Svector_set(v, i, Sinteger(sqlite3_stmt_status(ste.stmt, operations[i], reset)));
+  return v;
+}
+
+ptr osi::GetDatabaseStatus(iptr database, int operation, bool reset)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetDatabaseStatus", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::GetDatabaseStatus", ERROR_ACCESS_DENIED);
+  int current;
+  int highwater;
+  int rc = sqlite3_db_status(dbe.db, operation, &current, &highwater, reset);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_db_status", rc);
+  ptr v = Smake_vector(2, Sfixnum(0));
+  Svector_set(v, 0, Sinteger(current));
+  Svector_set(v, 1, Sinteger(highwater));
+  return v;
+}
+
+ptr osi::StartBackup(iptr database, ptr filename)
+{
+  if (!Sstringp(filename))
+    return MakeErrorPair("osi::StartBackup", ERROR_BAD_ARGUMENTS);
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::StartBackup", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::StartBackup", ERROR_ACCESS_DENIED);
+  UTF8String u8filename(filename);
+  BackupEntry be;
+  be.db_handle = database;
+  be.busy = false;
+  int rc = sqlite3_open_v2(u8filename.GetBuffer(), &(be.dest), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (SQLITE_OK != rc)
+  {
+    if (be.dest)
+    {
+      rc = sqlite3_extended_errcode(be.dest);
+      sqlite3_close(be.dest);
+    }
+    return MakeSQLiteErrorPair("sqlite3_open_v2", rc);
+  }
+  be.backup = sqlite3_backup_init(be.dest, "main", dbe.db, "main");
+  if (NULL == be.backup)
+  {
+    rc = sqlite3_extended_errcode(be.dest);
+    sqlite3_close(be.dest);
+    return MakeSQLiteErrorPair("sqlite3_backup_init", rc);
+  }
+  return Sfixnum(g_Backups.Allocate(be));
+}
+
+ptr osi::BackupStep(iptr backup, int pages, ptr callback)
+{
+  class BackupStepper : public DatabaseWorkItem
+  {
+  public:
+    sqlite3_backup* Backup;
+    iptr Handle;
+    int Pages;
+    ptr Callback;
+    int Remaining;
+    int Total;
+    BackupStepper(const BackupEntry& be, iptr handle, int pages, ptr callback) :
+      DatabaseWorkItem(be.db_handle)
+    {
+      // The step reads through the source connection, so it runs on
+      // that connection's thread.
+      Backup = be.backup;
+      Handle = handle;
+      Pages = pages;
+      Callback = callback;
+      SetBackupBusy(Handle, true);
+      Slock_object(Callback);
+    }
+    virtual ~BackupStepper()
+    {
+      SetBackupBusy(Handle, false);
+      Sunlock_object(Callback);
+    }
+    virtual DWORD Work()
+    {
+      int rc = sqlite3_backup_step(Backup, Pages);
+      Remaining = sqlite3_backup_remaining(Backup);
+      Total = sqlite3_backup_pagecount(Backup);
+      return rc;
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      ptr callback = Callback;
+      ptr arg;
+      if ((SQLITE_OK == error) || (SQLITE_DONE == error))
+      {
+        arg = Smake_vector(3, Sfixnum(0));
+        Svector_set(arg, 0, Sinteger32(Remaining));
+        Svector_set(arg, 1, Sinteger32(Total));
+        Svector_set(arg, 2, Sboolean(SQLITE_DONE == error));
+      }
+      else
+        arg = MakeSQLiteErrorPair("sqlite3_backup_step", error);
+      delete this;
+      return MakeList(callback, arg);
+    }
+  };
+
+  BackupEntry be = LookupBackup(backup);
+  if (NULL == be.backup)
+    return MakeErrorPair("osi::BackupStep", ERROR_INVALID_HANDLE);
+  if (be.busy)
+    return MakeErrorPair("osi::BackupStep", ERROR_ACCESS_DENIED);
+  if ((0 == pages) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::BackupStep", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new BackupStepper(be, backup, pages, callback));
+}
+
+ptr osi::FinishBackup(iptr backup)
+{
+  BackupEntry be = LookupBackup(backup);
+  if (NULL == be.backup)
+    return MakeErrorPair("osi::FinishBackup", ERROR_INVALID_HANDLE);
+  if (be.busy || LookupDatabase(be.db_handle).pending)
+    return MakeErrorPair("osi::FinishBackup", ERROR_ACCESS_DENIED);
+  int rc = FinishBackupEntry(be);
+  g_Backups.Deallocate(backup);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_backup_finish", rc);
+  return Strue;
+}
+
+ptr osi::CheckpointDatabase(iptr database, int mode, ptr callback)
+{
+  class Checkpointer : public DatabaseWorkItem
+  {
+  public:
+    sqlite3* DB;
+    DatabaseShared* Shared;
+    int Mode;
+    ptr Callback;
+    int LogFrames;
+    int CheckpointedFrames;
+    Checkpointer(const DatabaseEntry& dbe, iptr database, int mode, ptr callback) :
+      DatabaseWorkItem(database)
+    {
+      DB = dbe.db;
+      Shared = dbe.shared;
+      Mode = mode;
+      Callback = callback;
+      Slock_object(Callback);
+    }
+    virtual ~Checkpointer()
+    {
+      Sunlock_object(Callback);
+    }
+    virtual DWORD Work()
+    {
+      int rc = sqlite3_wal_checkpoint_v2(DB, NULL, Mode, &LogFrames, &CheckpointedFrames);
+      // After a restart, the next commit writes from the start of the
+      // WAL.
+      if ((SQLITE_OK == rc) && (Mode >= SQLITE_CHECKPOINT_RESTART))
+        Shared->walFrames = 0;
+      return rc;
+    }
+    virtual ptr GetCompletionPacket(DWORD error)
+    {
+      ptr callback = Callback;
+      ptr arg;
+      if ((SQLITE_OK == error) || (SQLITE_BUSY == error))
+      {
+        arg = Smake_vector(3, Sfixnum(0));
+        Svector_set(arg, 0, Sinteger32(LogFrames));
+        Svector_set(arg, 1, Sinteger32(CheckpointedFrames));
+        Svector_set(arg, 2, Sboolean(SQLITE_BUSY == error));
+      }
+      else
+        arg = MakeSQLiteErrorPair("sqlite3_wal_checkpoint_v2", error);
+      delete this;
+      return MakeList(callback, arg);
+    }
+  };
+
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::CheckpointDatabase", ERROR_INVALID_HANDLE);
+  if ((mode < SQLITE_CHECKPOINT_PASSIVE) || (mode > SQLITE_CHECKPOINT_TRUNCATE) || !Sprocedurep(callback))
+    return MakeErrorPair("osi::CheckpointDatabase", ERROR_BAD_ARGUMENTS);
+  return StartDatabaseWorker(new Checkpointer(dbe, database, mode, callback));
+}
+
+ptr osi::GetWalFrames(iptr database)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetWalFrames", ERROR_INVALID_HANDLE);
+  return Sinteger32(dbe.shared->walFrames);
+}
+
+ptr osi::SetAutoCheckpoint(iptr database, UINT32 frames)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetAutoCheckpoint", ERROR_INVALID_HANDLE);
+  dbe.shared->autoCheckpoint = (LONG)(frames > MAXLONG ? MAXLONG : frames);
+  return Strue;
+}
+
+ptr osi::PrepareCachedStatement(iptr database, ptr sql)
+{
+  if (!Sstringp(sql))
+    return MakeErrorPair("osi::PrepareCachedStatement", ERROR_BAD_ARGUMENTS);
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::PrepareCachedStatement", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::PrepareCachedStatement", ERROR_ACCESS_DENIED);
+  UTF8String u8sql(sql);
+  size_t len = u8sql.GetLength();
+  if (len > MAXLONG)
+    return MakeSQLiteErrorPair("sqlite3_prepare_v3", SQLITE_TOOBIG);
+  StatementCache* cache = dbe.cache;
+  std::string key(u8sql.GetBuffer(), len);
+  CachedStatementIndex::iterator found = cache->index.find(key);
+  if (cache->index.end() != found)
+  {
+    cache->hits++;
+    cache->entries.splice(cache->entries.begin(), cache->entries, found->second);
+    cache->inUse.insert(found->second->second);
+    return Sfixnum(found->second->second);
+  }
+  cache->misses++;
+  StatementEntry ste;
+  ste.db_handle = database;
+  ste.scratch = NULL;
+  ste.cached = true;
+  int rc = sqlite3_prepare_v3(dbe.db, u8sql.GetBuffer(), static_cast<long>(len), SQLITE_PREPARE_PERSISTENT, &(ste.stmt), NULL);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_prepare_v3", rc);
+  iptr statement = g_Statements.Allocate(ste);
+  cache->entries.push_front(std::make_pair(key, statement));
+  cache->index[key] = cache->entries.begin();
+  cache->inUse.insert(statement);
+  TrimStatementCache(cache);
+  return Sfixnum(statement);
+}
+
+ptr osi::ReleaseCachedStatements(iptr database)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::ReleaseCachedStatements", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::ReleaseCachedStatements", ERROR_ACCESS_DENIED);
+  dbe.cache->inUse.clear();
+  TrimStatementCache(dbe.cache);
+  return Strue;
+}
+
+ptr osi::SetStatementCacheLimit(iptr database, UINT32 limit)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::SetStatementCacheLimit", ERROR_INVALID_HANDLE);
+  if (0 == limit)
+    return MakeErrorPair("osi::SetStatementCacheLimit", ERROR_BAD_ARGUMENTS);
+  if (dbe.pending)
+    return MakeErrorPair("osi::SetStatementCacheLimit", ERROR_ACCESS_DENIED);
+  dbe.cache->limit = limit;
+  TrimStatementCache(dbe.cache);
+  return Strue;
+}
+
+ptr osi::GetStatementCacheStatistics(iptr database)
+{
+  // The counters are only changed on the Scheme thread, so they may be
+  // read while the database is busy.
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetStatementCacheStatistics", ERROR_INVALID_HANDLE);
+  StatementCache* cache = dbe.cache;
+  UINT64 lookups = cache->hits + cache->misses;
+  ptr v = Smake_vector(7, Sfixnum(0));
+  Svector_set(v, 0, Sstring_to_symbol("<statement-cache-statistics>"));
+  Svector_set(v, 1, Sunsigned64(cache->hits));
+  Svector_set(v, 2, Sunsigned64(cache->misses));
+  Svector_set(v, 3, Sflonum((0 == lookups) ? 0.0 : static_cast<double>(cache->hits) / lookups));
+  Svector_set(v, 4, Sunsigned64(cache->evictions));
+  Svector_set(v, 5, Sunsigned(cache->entries.size()));
+  Svector_set(v, 6, Sunsigned(cache->limit));
+  return v;
+}
+
+ptr osi::GetCachedStatements(iptr database)
+{
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::GetCachedStatements", ERROR_INVALID_HANDLE);
+  CachedStatementList& entries = dbe.cache->entries;
+  ptr v = Smake_vector(static_cast<iptr>(entries.size()), Sfixnum(0));
+  iptr i = 0;
+  for (CachedStatementList::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
+    Svector_set(v, i++, Sfixnum(iter->second));
+  return v;
+}
+
+ptr osi::OpenBlob(iptr database, ptr table, ptr column, INT64 rowid, bool writable)
+{
+  if (!Sstringp(table) || !Sstringp(column))
+    return MakeErrorPair("osi::OpenBlob", ERROR_BAD_ARGUMENTS);
+  DatabaseEntry dbe = LookupDatabase(database);
+  if (NULL == dbe.db)
+    return MakeErrorPair("osi::OpenBlob", ERROR_INVALID_HANDLE);
+  if (dbe.pending)
+    return MakeErrorPair("osi::OpenBlob", ERROR_ACCESS_DENIED);
+  UTF8String u8table(table);
+  UTF8String u8column(column);
+  sqlite3_blob* blob;
+  int rc = sqlite3_blob_open(dbe.db, "main", u8table.GetBuffer(), u8column.GetBuffer(), rowid, writable ? 1 : 0, &blob);
+  if (SQLITE_OK != rc)
+    return MakeSQLiteErrorPair("sqlite3_blob_open", rc);
+  return PortToScheme(new BlobPort(blob, database, writable));
+}
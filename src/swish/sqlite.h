@@ -29,29 +29,119 @@ namespace osi
   ptr PrepareStatement(iptr database, ptr sql);
   ptr FinalizeStatement(iptr statement);
   ptr BindStatement(iptr statement, UINT index, ptr datum);
+  ptr BindStatementAll(iptr statement, ptr values);
   ptr ClearStatementBindings(iptr statement);
   ptr GetLastInsertRowid(iptr database);
+  ptr GetAutocommit(iptr database);
   ptr GetStatementColumns(iptr statement);
   ptr GetStatementSQL(iptr statement);
   ptr ResetStatement(iptr statement);
   ptr StepStatement(iptr statement, ptr callback);
+  ptr StepStatementN(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback);
+  ptr StepStatementColumnar(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback);
+  ptr StepStatementAsJSON(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback);
+  ptr StepStatementAsCSV(iptr statement, UINT32 maxRows, size_t maxBytes, ptr callback);
+  ptr ExecuteBatch(iptr statement, ptr bindings, ptr callback);
+  ptr AppendLog(iptr database, ptr sql, ptr bindings);
+  ptr GetLogCount(iptr database);
+  ptr SetLogBufferLimit(iptr database, size_t bytes);
+  ptr DrainLogs(iptr database, UINT32 maxRecords, ptr callback);
+  ptr ConfigureSQLite(UINT32 pageSize, UINT32 pageCount, UINT32 lookasideSize, UINT32 lookasideCount, bool memoryStatus);
+  ptr SetSoftHeapLimit(INT64 limit);
   ptr GetSQLiteStatus(int operation, bool reset);
+  ptr GetStatementStatus(iptr statement, bool reset);
+  ptr GetDatabaseStatus(iptr database, int operation, bool reset);
+  ptr SetSlowQueryTrace(UINT32 thresholdMilliseconds, UINT32 sampleEvery, ptr callback);
+  ptr SetDatabaseTrace(iptr database, bool enabled);
+  ptr SetDatabaseTimeout(iptr database, UINT32 milliseconds);
+  ptr InterruptDatabase(iptr database);
+  ptr SetDatabaseMemoryMap(iptr database, INT64 bytes);
+  ptr SetDatabaseCacheSize(iptr database, int size);
+  ptr SetDatabaseLookaside(iptr database, UINT32 slotSize, UINT32 slotCount);
+  ptr StartBackup(iptr database, ptr filename);
+  ptr BackupStep(iptr backup, int pages, ptr callback);
+  ptr FinishBackup(iptr backup);
+  ptr CheckpointDatabase(iptr database, int mode, ptr callback);
+  ptr GetWalFrames(iptr database);
+  ptr SetAutoCheckpoint(iptr database, UINT32 frames);
+  ptr PrepareCachedStatement(iptr database, ptr sql);
+  ptr ReleaseCachedStatements(iptr database);
+  ptr SetStatementCacheLimit(iptr database, UINT32 limit);
+  ptr GetStatementCacheStatistics(iptr database);
+  ptr GetCachedStatements(iptr database);
+  ptr OpenBlob(iptr database, ptr table, ptr column, INT64 rowid, bool writable);
+  ptr OpenCursor(iptr statement, UINT32 batchRows, UINT32 maxBatches);
+  ptr ReadCursor(iptr cursor, ptr callback);
+  ptr CloseCursor(iptr cursor, ptr callback);
 }
 
+// Used by the progress handler and WAL hook on worker threads.
+struct DatabaseShared
+{
+  volatile UINT32 timeout;
+  volatile ULONGLONG deadline;
+  volatile LONG timedOut;
+  volatile LONG walFrames;
+  volatile LONG autoCheckpoint;
+};
+
+class DatabaseThread;
+struct LogBuffer;
+
+// Statements prepared by osi::PrepareCachedStatement, keyed by UTF-8
+// SQL text.
+typedef std::list<std::pair<std::string, iptr> > CachedStatementList;
+typedef std::unordered_map<std::string, CachedStatementList::iterator> CachedStatementIndex;
+
+struct StatementCache
+{
+  CachedStatementList entries; // most recently used first
+  CachedStatementIndex index;
+  std::unordered_set<iptr> inUse; // returned since the last release
+  size_t limit;
+  UINT64 hits;
+  UINT64 misses;
+  UINT64 evictions;
+};
+
 typedef struct
 {
   sqlite3* db;
-  bool busy;
+  UINT32 pending;
+  DatabaseShared* shared;
+  DatabaseThread* thread;
+  StatementCache* cache;
+  LogBuffer* logs;
 } DatabaseEntry;
 
 typedef HandleMap<DatabaseEntry, 32783> DatabaseMap;
 extern DatabaseMap g_Databases;
 
+struct StatementScratch
+{
+  bool bound;
+  std::vector<char> text;
+  std::vector<ptr> pinned;
+};
+
 typedef struct
 {
   sqlite3_stmt* stmt;
   iptr db_handle;
+  StatementScratch* scratch;
+  bool cached;
 } StatementEntry;
 
 typedef HandleMap<StatementEntry, 32749> StatementMap;
 extern StatementMap g_Statements;
+
+typedef struct
+{
+  sqlite3_backup* backup;
+  sqlite3* dest;
+  iptr db_handle;
+  bool busy;
+} BackupEntry;
+
+typedef HandleMap<BackupEntry, 32707> BackupMap;
+extern BackupMap g_Backups;
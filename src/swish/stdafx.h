@@ -37,9 +37,14 @@
 #include <string.h>
 #include <setupapi.h>
 #include <winioctl.h>
+#include <algorithm>
+#include <deque>
+#include <list>
 #include <psapi.h>
 #include <shlwapi.h>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <wincrypt.h>
 #include <winsock2.h>
@@ -122,6 +122,24 @@ public:
     }
     return Strue;
   }
+  virtual ptr WriteShared(SharedBuffer* buffer, size_t startIndex, UINT32 size, ptr callback)
+  {
+    WSABUF buf;
+    buf.len = size;
+    buf.buf = (char*)buffer->Data + startIndex;
+    OverlappedRequest* req = new OverlappedRequest(buffer, callback);
+    DWORD n;
+    if (WSASend(Socket, &buf, 1, &n, 0, &req->Overlapped, NULL) != 0)
+    {
+      DWORD error = WSAGetLastError();
+      if (WSA_IO_PENDING != error)
+      {
+        delete req;
+        return MakeErrorPair("WSASend", error);
+      }
+    }
+    return Strue;
+  }
   virtual ptr Close()
   {
     shutdown(Socket, SD_SEND);